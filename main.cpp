@@ -0,0 +1,58 @@
+#include "prover.hpp"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+using namespace std;
+
+/*
+    The command line over the library: runs a program, then answers
+    requests with --serve; --bench and --worker are run_bench() and
+    run_worker(). Whatever goes wrong is printed and exits with 1.
+*/
+
+int
+report(const ProverStatus &status)
+{
+    if (status.ok()) return 0;
+    cerr << status.message << endl;
+    return 1;
+}
+
+
+int main(int argc, char ** argv)
+{
+    bool serve = argc >= 2 && string(argv[1]) == "--serve";
+    bool bench = argc >= 2 && string(argv[1]) == "--bench";
+    bool worker = argc >= 2 && string(argv[1]) == "--worker";
+    if (argc < 2 || (serve && argc != 4) || (bench && (argc < 3 || argc > 4)) || (worker && argc != 3)) {
+        cerr << "Usage: " << argv[0] << " [filename | -]" << endl;
+        cerr << "       " << argv[0] << " --serve [filename | -] [socket | -]" << endl;
+        cerr << "       " << argv[0] << " --bench [corpus] [random goals]" << endl;
+        cerr << "       " << argv[0] << " --worker [port]" << endl;
+        exit(1);
+    }
+    if (worker) {
+        return report(run_worker(atoi(argv[2])));
+    }
+    if (bench) {
+        return report(run_bench(argv[2], argc == 4 ? atoi(argv[3]) : 10, cout));
+    }
+    string input = serve ? argv[2] : argv[1];
+
+    // read from the file or from stdin for "-"
+    ifstream file;
+    if (input != "-") {
+        file.open(input);
+        if (!file) {
+            return report({ ProverError::IO, "Runtime Error: main() :: cannot open " + input + "." });
+        }
+    }
+    Prover prover;
+    ProverStatus status = prover.run(file.is_open() ? (istream &)file : cin, cout);
+    if (status.ok() && serve) {
+        status = string(argv[3]) == "-" ? prover.serve(0, 1) : prover.listen(argv[3]);
+    }
+    return report(status);
+}
@@ -1,14 +1,49 @@
+#include "prover.hpp"
+
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <queue>
 #include <set>
 #include <algorithm>
 #include <chrono>
 #include <iomanip>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <future>
+#include <exception>
+#include <deque>
+#include <memory_resource>
+#include <climits>
+#include <tuple>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <csignal>
+#include <random>
+#include <cerrno>
 using namespace std;
 
 /*
@@ -21,21 +56,47 @@ binary_operator -> '*' | '+'
 unary_operator -> '~'
 int_param -> 'max_tree_size'
            | 'max_search_depth'
+           | 'threads'
+           | 'jobs'
+           | 'max_lemmas'
+           | 'spill_memory'
+           | 'time_limit_ms'
+           | 'memory_limit_mb'
+           | 'progress_ms'
 bool_param -> 'use_proofs_as_axioms'
+            | 'ac_normalize'
+            | 'semantic_check'
+            | 'stats'
+            | 'completion'
+mode_param -> 'search_mode'
+search_mode -> 'bfs' | 'bidirectional' | 'ida_star' | 'egraph' | 'best_first'
+orientation_param -> 'lemma_orientation'
+orientation -> 'both' | 'shrinking'
+string_param -> 'proof_cache'
+              | 'spill_dir'
+              | 'workers'
+string -> '"' { <any character but '"' or newline> }* '"'
 formula -> <primitive>
          | <id>
          | '(' <binary_operator> <formula> <formula> ')'
          | '(' <unary_operator> <formula> ')'
+builtin_axiom -> 'ass_add' | 'ass_mul' | 'com_add' | 'com_mul'
+               | 'abs_add' | 'abs_mul' | 'ide_add' | 'ide_mul'
+               | 'dis_add' | 'dis_mul' | 'inv_add' | 'inv_mul'
 command -> 'axiom' <id> ':' <formula> '=' <formula> '.'
+         | 'axiom' <builtin_axiom> ':' 'builtin' '.'
          | 'prove' <formula> '.'
          | 'param' <int_param> <int> '.'
          | 'param' <bool_param> <bool> '.'
+         | 'param' <mode_param> <search_mode> '.'
+         | 'param' <orientation_param> <orientation> '.'
+         | 'param' <string_param> <string> '.'
 */
 
-bool is_bop_token(string tok) { return tok == "*" || tok == "+"; }
-bool is_uop_token(string tok) { return tok == "~"; }
-bool is_prim_token(string tok) { return tok == "0" || tok == "1"; }
-bool is_id_token(string tok) {
+bool is_bop_token(string_view tok) { return tok == "*" || tok == "+"; }
+bool is_uop_token(string_view tok) { return tok == "~"; }
+bool is_prim_token(string_view tok) { return tok == "0" || tok == "1"; }
+bool is_id_token(string_view tok) {
     if (tok.size() == 0) return false;
     if (tok[0] != '_' && !isalpha(tok[0])) return false;
     for (char c : tok) {
@@ -47,43 +108,94 @@ bool is_id_token(string tok) {
 }
 
 bool is_single_char_token(char tok) {
-    string toks = string("*+~=:().");
-    return toks.find(tok) != string::npos;
+    return tok != '\0' && strchr("*+~=:().", tok) != nullptr;
 }
 
-bool is_pos_int_token(string tok) {
+bool is_pos_int_token(string_view tok) {
+    // at most 9 digits, so it always fits an int
+    if (tok.size() == 0 || tok.size() > 9) return false;
     for (char c : tok) {
         if (!isdigit(c)) return false;
     }
     return true;
 }
 
-bool is_pos_int_param_token(string tok) {
+bool is_pos_int_param_token(string_view tok) {
     return tok == "max_tree_size" ||
-           tok == "max_search_depth";
+           tok == "max_search_depth" ||
+           tok == "threads" ||
+           tok == "jobs" ||
+           tok == "max_lemmas" ||
+           tok == "spill_memory" ||
+           tok == "time_limit_ms" ||
+           tok == "memory_limit_mb" ||
+           tok == "progress_ms";
+}
+
+bool is_bool_param_token(string_view tok) {
+    return tok == "use_proofs_as_axioms" ||
+           tok == "ac_normalize" ||
+           tok == "semantic_check" ||
+           tok == "stats" ||
+           tok == "completion";
+}
+
+bool is_mode_param_token(string_view tok) {
+    return tok == "search_mode";
+}
+
+bool is_search_mode_token(string_view tok) {
+    return tok == "bfs" || tok == "bidirectional" || tok == "ida_star" || tok == "egraph" ||
+           tok == "best_first";
+}
+
+bool is_orientation_param_token(string_view tok) {
+    return tok == "lemma_orientation";
+}
+
+bool is_orientation_token(string_view tok) {
+    return tok == "both" || tok == "shrinking";
+}
+
+bool is_string_param_token(string_view tok) {
+    return tok == "proof_cache" || tok == "spill_dir" || tok == "workers";
 }
 
-bool is_bool_param_token(string tok) {
-    return tok == "use_proofs_as_axioms";
+bool is_string_token(string_view tok) {
+    return tok.size() >= 2 && tok.front() == '"' && tok.back() == '"';
 }
 
-bool is_bool_token(string tok) {
+bool is_bool_token(string_view tok) {
     return tok == "true" || tok == "false";
 }
 
-void
-perror(string line, string msg, int line_number, int col)
+string
+format_error(string line, string msg, int line_number, int col)
 {
-    cerr << line << endl;
-    for (int i = 0; i < col-1; i++) cerr << ' ';
-    cerr << '^' << endl;
-    cerr << "Error (line " << line_number << ", column " << col << "): " << msg << endl;
+    stringstream out;
+    out << line << endl;
+    for (int i = 0; i < col-1; i++) out << ' ';
+    out << '^' << endl;
+    out << "Error (line " << line_number << ", column " << col << "): " << msg << endl;
+    return out.str();
 }
 
-void
-rerror(string msg)
+/*
+    Errors unwind to the entry points of the library (see Prover), which
+    return them as a ProverStatus; nothing below them prints an error or
+    exits. The message is what the command line prints: format_error()'s
+    text for a syntax error in the input, "Runtime Error: function() ::
+    what went wrong." for anything else.
+*/
+struct ProverFailure {
+    ProverError error;
+    string message;
+};
+
+[[noreturn]] void
+throw_failure(ProverError error, const string &message)
 {
-    cerr << "Runtime Error: " << msg << endl;
+    throw ProverFailure{ error, "Runtime Error: " + message };
 }
 
 enum NodeType {
@@ -96,78 +208,703 @@ struct Node {
     string token;
     NodeType type;
     vector<Node> children;
+    uint32_t term = UINT32_MAX;  // the formula's TermId if parsed straight into a store
+};
+
+/*
+    Formulas are hash-consed into a TermStore: every distinct subterm is
+    stored exactly once and referred to by a 32-bit TermId, and operator,
+    variable and primitive tokens are interned as small integer Symbols.
+    Two terms are structurally equal iff their ids are equal, and rewriting
+    a subterm shares every subtree it does not touch.
+
+    Each term also caches a 64-bit structural hash, computed from its
+    symbol name and its children's hashes when it is built. It depends only
+    on the structure of the term (not on ids or interning order), and it is
+    what both the intern table and the search tables probe with.
+*/
+typedef uint32_t TermId;
+typedef uint32_t Symbol;
+
+const TermId NO_TERM = UINT32_MAX;
+
+inline uint64_t
+mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t
+hash_combine(uint64_t h, uint64_t v)
+{
+    return mix64(h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+uint64_t
+hash_string(string_view s)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : s) {
+        h ^= (unsigned char)c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+    Append-only vector whose elements never move: they live in fixed-size
+    segments, so a thread may read any element it was handed the index of
+    while other threads keep appending.
+*/
+template <typename T>
+class SegmentedVector {
+public:
+    // segment s holds FIRST_SIZE << s elements, so a few small segments
+    // serve small vectors and 32 of them cover every 32-bit index
+    static const size_t FIRST_BITS = 10;
+    static const size_t FIRST_SIZE = (size_t)1 << FIRST_BITS;
+    static const size_t MAX_SEGMENTS = 32;
+
+    SegmentedVector() : count(0) {
+        for (size_t i = 0; i < MAX_SEGMENTS; i++) segments[i] = nullptr;
+    }
+    ~SegmentedVector() {
+        for (size_t i = 0; i < MAX_SEGMENTS; i++) delete[] segments[i].load();
+    }
+    SegmentedVector(const SegmentedVector &) = delete;
+    SegmentedVector &operator=(const SegmentedVector &) = delete;
+
+    uint32_t push_back(const T &value) {
+        uint32_t i = count.fetch_add(1);
+        size_t s = segment_of(i);
+        segment(s)[i - start_of(s)] = value;
+        return i;
+    }
+    T &operator[](size_t i) {
+        size_t s = segment_of(i);
+        return segments[s].load(memory_order_acquire)[i - start_of(s)];
+    }
+    const T &operator[](size_t i) const {
+        size_t s = segment_of(i);
+        return segments[s].load(memory_order_acquire)[i - start_of(s)];
+    }
+    size_t size() const {
+        return count.load();
+    }
+
+private:
+    atomic<T *> segments[MAX_SEGMENTS];
+    atomic<uint32_t> count;
+    mutex alloc_lock;
+
+    static size_t segment_of(size_t i) {
+        return 63 - __builtin_clzll((i >> FIRST_BITS) + 1);
+    }
+    static size_t start_of(size_t s) {
+        return (((size_t)1 << s) - 1) << FIRST_BITS;
+    }
+    T *segment(size_t s) {
+        T *seg = segments[s].load(memory_order_acquire);
+        if (seg) return seg;
+        lock_guard<mutex> guard(alloc_lock);
+        seg = segments[s].load(memory_order_acquire);
+        if (!seg) {
+            seg = new T[FIRST_SIZE << s];
+            segments[s].store(seg, memory_order_release);
+        }
+        return seg;
+    }
+};
+
+// 32 bytes; every state of a search adds a few of these, see SearchState
+struct Term {
+    static const uint32_t MAX_FRESH = (1U << 26) - 1;
+
+    Symbol sym;
+    TermId children[2];
+    uint32_t width;       // length of the rendered term, see to_string()
+    uint32_t size;        // number of nodes
+    uint32_t fresh : 26;  // every ?N variable in the term has N < fresh
+    uint32_t arity : 2;
+    NodeType type : 4;
+    uint64_t hash;
+};
+static_assert(sizeof(Term) == 32);
+
+class SymbolTable {
+public:
+    Symbol intern(string_view name) {
+        lock_guard<mutex> guard(lock);
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        Symbol sym = (Symbol)names.push_back(string(name));
+        hashes.push_back(hash_string(name));
+        fresh_bounds.push_back(fresh_bound(name));
+        ids[names[sym]] = sym;  // names never move, so the key can view them
+        return sym;
+    }
+    const string &name(Symbol sym) const {
+        return names[sym];
+    }
+    uint64_t hash(Symbol sym) const {
+        return hashes[sym];
+    }
+    // N+1 for the name ?N of a generated variable, 0 otherwise
+    uint32_t fresh(Symbol sym) const {
+        return fresh_bounds[sym];
+    }
+
+private:
+    mutex lock;
+    SegmentedVector<string> names;
+    SegmentedVector<uint64_t> hashes;
+    SegmentedVector<uint32_t> fresh_bounds;
+    unordered_map<string_view, Symbol> ids;
+
+    static uint32_t fresh_bound(string_view name) {
+        if (name.size() < 2 || name[0] != '?') return 0;
+        // saturates at Term::MAX_FRESH, which is still sound for a longer
+        // ?N: the names generated from the bound never count up that far
+        uint64_t n = 0;
+        for (char c : name.substr(1)) n = min<uint64_t>(10 * n + (uint64_t)(c - '0'), Term::MAX_FRESH - 1);
+        return (uint32_t)n + 1;
+    }
+};
+
+/*
+    The store is safe to use from several threads at once: the intern
+    table is split into shards by hash, each behind its own lock, and
+    terms never move once built.
+
+    A store can also be layered over a shared base store, which is how each
+    proof gets its own arena of terms: the overlay sees the base terms that
+    existed when it was created, adds new terms to itself under ids tagged
+    with LOCAL, and all of them are released at once when it is destroyed.
+    Symbols always live in the base store.
+*/
+class TermStore {
+public:
+    static const TermId LOCAL = 1U << 31;
+
+    TermStore() : own_symbols(make_unique<SymbolTable>()), symbols(*own_symbols),
+                  base(nullptr), base_limit(0), tag(0) {
+        for (Shard &shard : shards) shard.slots.assign(64, NO_TERM);
+    }
+    explicit TermStore(TermStore *_base) : symbols(_base->symbols),
+                  base(_base), base_limit((TermId)_base->size()), tag(LOCAL) {
+        for (Shard &shard : shards) shard.slots.assign(64, NO_TERM);
+    }
+
+private:
+    unique_ptr<SymbolTable> own_symbols;
+
+public:
+    SymbolTable &symbols;
+
+    TermId make(NodeType type, Symbol sym, int arity = 0, TermId a = 0, TermId b = 0) {
+        Term t;
+        t.sym = sym;
+        t.children[0] = arity >= 1 ? a : 0;
+        t.children[1] = arity >= 2 ? b : 0;
+        t.size = 1;
+        t.arity = (uint32_t)arity;
+        t.type = type;
+        uint64_t h = hash_combine((uint64_t)type, symbols.hash(sym));
+        t.width = (uint32_t)symbols.name(sym).size();
+        t.fresh = symbols.fresh(sym);
+        for (int k = 0; k < arity; k++) {
+            const Term &child = (*this)[t.children[k]];
+            h = hash_combine(h, child.hash);
+            t.width += (k == 0 ? (arity == 1 ? 3 : 4) : 0) + child.width;
+            t.size += child.size;
+            t.fresh = max<uint32_t>(t.fresh, child.fresh);
+        }
+        t.hash = h;
+
+        // a term with a child of this store's own cannot be in the base
+        bool own_child = (arity >= 1 && (a & LOCAL) == tag) || (arity >= 2 && (b & LOCAL) == tag);
+        if (base && !own_child) {
+            TermId id = base->find(t, base_limit);
+            if (id != NO_TERM) return id;
+        }
+
+        Shard &shard = shards[h >> (64 - SHARD_BITS)];
+        lock_guard<mutex> guard(shard.lock);
+        size_t i = probe(shard, t);
+        if (shard.slots[i] != NO_TERM) {
+            return shard.slots[i];
+        }
+        TermId id = terms.push_back(t) | tag;
+        shard.slots[i] = id;
+        if (2 * ++shard.count > shard.slots.size()) grow(shard);
+        return id;
+    }
+    TermId make_leaf(NodeType type, const string &token) {
+        return make(type, symbols.intern(token));
+    }
+    const Term &operator[](TermId id) const {
+        if ((id & LOCAL) != tag) return (*base)[id];
+        return terms[id & ~LOCAL];
+    }
+    uint64_t hash(TermId id) const {
+        return (*this)[id].hash;
+    }
+    size_t size() const {
+        return terms.size();
+    }
+
+private:
+    static const int SHARD_BITS = 6;
+
+    // open-addressing intern table of term ids, linear probing on the hash
+    struct Shard {
+        mutex lock;
+        vector<TermId> slots;
+        size_t count = 0;
+    };
+
+    TermStore *base;
+    TermId base_limit;
+    TermId tag;
+    SegmentedVector<Term> terms;
+    Shard shards[1 << SHARD_BITS];
+
+    // slot holding a term equal to t, or the empty slot it would go in
+    size_t probe(const Shard &shard, const Term &t) const {
+        size_t mask = shard.slots.size() - 1;
+        size_t i = t.hash & mask;
+        while (shard.slots[i] != NO_TERM) {
+            const Term &u = terms[shard.slots[i] & ~LOCAL];
+            if (u.hash == t.hash && u.type == t.type && u.sym == t.sym && u.arity == t.arity &&
+                u.children[0] == t.children[0] && u.children[1] == t.children[1]) {
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+    // id of the term equal to t among the first `limit` terms, or NO_TERM
+    TermId find(const Term &t, TermId limit) {
+        Shard &shard = shards[t.hash >> (64 - SHARD_BITS)];
+        lock_guard<mutex> guard(shard.lock);
+        TermId id = shard.slots[probe(shard, t)];
+        return id < limit ? id : NO_TERM;
+    }
+    void grow(Shard &shard) {
+        vector<TermId> old(shard.slots.size() * 2, NO_TERM);
+        shard.slots.swap(old);
+        size_t mask = shard.slots.size() - 1;
+        for (TermId id : old) {
+            if (id == NO_TERM) continue;
+            size_t i = terms[id & ~LOCAL].hash & mask;
+            while (shard.slots[i] != NO_TERM) i = (i + 1) & mask;
+            shard.slots[i] = id;
+        }
+    }
+};
+
+
+// Interns into `to` the term `id` of the store `from`.
+TermId
+copy_term(TermStore &to, const TermStore &from, TermId id)
+{
+    const Term &t = from[id];
+    TermId children[2] = { 0, 0 };
+    for (int i = 0; i < t.arity; i++) {
+        children[i] = copy_term(to, from, t.children[i]);
+    }
+    return to.make(t.type, t.sym, t.arity, children[0], children[1]);
+}
+
+/*
+    Open-addressing map from interned terms to dense indices (e.g. into a
+    vector of search states), probed with the terms' cached hashes. Since
+    terms are hash-consed, keys compare by id.
+*/
+class TermIndex {
+public:
+    static const uint32_t NONE = UINT32_MAX;
+
+    TermIndex(pmr::memory_resource *mem = pmr::get_default_resource())
+        : count(0), slots(1024, { NO_TERM, NONE }, mem) {}
+
+    uint32_t find(const TermStore &ts, TermId key) const {
+        size_t mask = slots.size() - 1;
+        size_t i = ts.hash(key) & mask;
+        while (slots[i].first != NO_TERM) {
+            if (slots[i].first == key) return slots[i].second;
+            i = (i + 1) & mask;
+        }
+        return NONE;
+    }
+    // Returns false (and leaves the table unchanged) if key is present.
+    bool insert(const TermStore &ts, TermId key, uint32_t value) {
+        size_t mask = slots.size() - 1;
+        size_t i = ts.hash(key) & mask;
+        while (slots[i].first != NO_TERM) {
+            if (slots[i].first == key) return false;
+            i = (i + 1) & mask;
+        }
+        slots[i] = { key, value };
+        if (2 * ++count > slots.size()) grow(ts);
+        return true;
+    }
+    size_t size() const {
+        return count;
+    }
+
+private:
+    size_t count;
+    pmr::vector<pair<TermId, uint32_t>> slots;
+
+    void grow(const TermStore &ts) {
+        pmr::vector<pair<TermId, uint32_t>> old(slots.size() * 2, { NO_TERM, NONE }, slots.get_allocator());
+        slots.swap(old);
+        size_t mask = slots.size() - 1;
+        for (auto &pr : old) {
+            if (pr.first == NO_TERM) continue;
+            size_t i = ts.hash(pr.first) & mask;
+            while (slots[i].first != NO_TERM) i = (i + 1) & mask;
+            slots[i] = pr;
+        }
+    }
 };
 
+struct BuiltinAxiom;
+
 struct Axiom {
     string name;
-    Node rule_a;
-    Node rule_b;
+    TermId rule_a;
+    TermId rule_b;
+    bool oriented = false;  // only ever rewrite rule_a into rule_b
+    const BuiltinAxiom *builtin = nullptr;  // compiled kernels for the rules, if any
 };
 
+/*
+    Names the variables a rule introduces (those of its right-hand side
+    that the left-hand side does not bind). Starting from the `fresh` bound
+    of the term being rewritten keeps the names new to that term and makes
+    them depend only on the term, not on the order states are expanded in.
+*/
 class VariableNameGenerator {
 public:
-    int idx;
+    uint32_t idx;
     VariableNameGenerator() : idx(0) {}
+    VariableNameGenerator(uint32_t start) : idx(start) {}
     string next() {
-        return "?" + to_string(idx++);
+        string name = "?";
+        name += to_string(idx++);
+        return name;
+    }
+};
+
+/*
+    The widths (see to_string()) a rewrite may give, so that successors
+    over max_tree_size are rejected as soon as the rule has matched, before
+    anything is built: at most max, or exactly exact, which searches set to
+    the target's width because the target is never pruned, however wide.
+    The default allows every width.
+*/
+struct WidthBound {
+    uint32_t max = UINT32_MAX;
+    uint32_t exact = UINT32_MAX;
+
+    bool limited() const {
+        return max != UINT32_MAX;
+    }
+    bool allows(uint32_t width) const {
+        return width <= max || width == exact;
+    }
+    // The bound on a subterm of the given width, within a term of width total.
+    WidthBound inside(uint32_t total, uint32_t width) const {
+        if (!limited()) return *this;
+        uint32_t rest = total - width;
+        // no term has width 0, so 0 allows nothing
+        return { max >= rest ? max - rest : 0, exact != UINT32_MAX && exact >= rest ? exact - rest : 0 };
+    }
+};
+
+/*
+    Built-in axioms, enabled by name with `axiom ide_add : builtin.`. Each
+    side is a pattern type, and Pattern<> turns it into a matcher and a
+    builder at compile time: the shape, the symbols and the repeated
+    variables of the rule are all constants, so applying it is a few
+    inlined comparisons and make() calls instead of walking the rule term,
+    filling a Scope and collecting the right-hand side's variables as
+    apply_transformation() does. The rewrites, and the names chosen for
+    variables the right-hand side introduces, are the same as for the
+    axiom written out, so proofs do not change.
+*/
+template <int N> struct PatVar {};  // the variables a, b, c are 0, 1, 2
+template <char C> struct PatPrim {};
+template <char C, typename A> struct PatOp1 {};
+template <char C, typename A, typename B> struct PatOp2 {};
+
+// The symbols the patterns are made of, interned once per symbol table.
+struct KernelSymbols {
+    Symbol add, mul, neg, zero, one;
+
+    KernelSymbols(SymbolTable &table)
+        : add(table.intern("+")), mul(table.intern("*")), neg(table.intern("~")),
+          zero(table.intern("0")), one(table.intern("1")) {}
+
+    template <char C>
+    Symbol of() const {
+        if constexpr (C == '+') return add;
+        else if constexpr (C == '*') return mul;
+        else if constexpr (C == '~') return neg;
+        else if constexpr (C == '0') return zero;
+        else {
+            static_assert(C == '1', "no such builtin symbol");
+            return one;
+        }
+    }
+};
+
+// What the pattern variables are bound to; bit N of bound is set once PatVar<N> is.
+struct KernelMatch {
+    TermId vars[3] = { NO_TERM, NO_TERM, NO_TERM };
+    unsigned bound = 0;
+};
+
+template <typename P> struct Pattern;
+
+template <int N>
+struct Pattern<PatVar<N>> {
+    static_assert(N < 3, "builtin patterns have at most three variables");
+
+    static bool match(const TermStore &, const KernelSymbols &, TermId node, KernelMatch &m) {
+        if (m.bound & (1U << N)) return m.vars[N] == node;
+        m.vars[N] = node;
+        m.bound |= 1U << N;
+        return true;
+    }
+    static void bind_fresh(TermStore &ts, KernelMatch &m, VariableNameGenerator &var_gen) {
+        if (m.bound & (1U << N)) return;
+        m.vars[N] = ts.make_leaf(UNRES, var_gen.next());
+        m.bound |= 1U << N;
+    }
+    static TermId build(TermStore &, const KernelSymbols &, const KernelMatch &m) {
+        return m.vars[N];
+    }
+    static uint32_t width(const TermStore &ts, const KernelMatch &m) {
+        return ts[m.vars[N]].width;
+    }
+    static TermId instantiate(TermStore &ts) {
+        return ts.make_leaf(VAR, string(1, (char)('a' + N)));
+    }
+};
+
+template <char C>
+struct Pattern<PatPrim<C>> {
+    static bool match(const TermStore &ts, const KernelSymbols &s, TermId node, KernelMatch &) {
+        const Term &t = ts[node];
+        return t.type == PRIM && t.sym == s.of<C>();
     }
+    static void bind_fresh(TermStore &, KernelMatch &, VariableNameGenerator &) {}
+    static TermId build(TermStore &ts, const KernelSymbols &s, const KernelMatch &) {
+        return ts.make(PRIM, s.of<C>());
+    }
+    static uint32_t width(const TermStore &, const KernelMatch &) {
+        return 1;
+    }
+    static TermId instantiate(TermStore &ts) {
+        return ts.make_leaf(PRIM, string(1, C));
+    }
+};
+
+template <char C, typename A>
+struct Pattern<PatOp1<C, A>> {
+    static bool match(const TermStore &ts, const KernelSymbols &s, TermId node, KernelMatch &m) {
+        const Term &t = ts[node];
+        return t.type == OP && t.arity == 1 && t.sym == s.of<C>() &&
+               Pattern<A>::match(ts, s, t.children[0], m);
+    }
+    static void bind_fresh(TermStore &ts, KernelMatch &m, VariableNameGenerator &var_gen) {
+        Pattern<A>::bind_fresh(ts, m, var_gen);
+    }
+    static TermId build(TermStore &ts, const KernelSymbols &s, const KernelMatch &m) {
+        return ts.make(OP, s.of<C>(), 1, Pattern<A>::build(ts, s, m));
+    }
+    static uint32_t width(const TermStore &ts, const KernelMatch &m) {
+        return 4 + Pattern<A>::width(ts, m);  // "(~ a)"
+    }
+    static TermId instantiate(TermStore &ts) {
+        return ts.make(OP, ts.symbols.intern(string(1, C)), 1, Pattern<A>::instantiate(ts));
+    }
+};
+
+template <char C, typename A, typename B>
+struct Pattern<PatOp2<C, A, B>> {
+    static bool match(const TermStore &ts, const KernelSymbols &s, TermId node, KernelMatch &m) {
+        const Term &t = ts[node];
+        return t.type == OP && t.arity == 2 && t.sym == s.of<C>() &&
+               Pattern<A>::match(ts, s, t.children[0], m) &&
+               Pattern<B>::match(ts, s, t.children[1], m);
+    }
+    // in preorder, which is the order get_variables() would list them in
+    static void bind_fresh(TermStore &ts, KernelMatch &m, VariableNameGenerator &var_gen) {
+        Pattern<A>::bind_fresh(ts, m, var_gen);
+        Pattern<B>::bind_fresh(ts, m, var_gen);
+    }
+    static TermId build(TermStore &ts, const KernelSymbols &s, const KernelMatch &m) {
+        TermId a = Pattern<A>::build(ts, s, m);
+        TermId b = Pattern<B>::build(ts, s, m);
+        return ts.make(OP, s.of<C>(), 2, a, b);
+    }
+    static uint32_t width(const TermStore &ts, const KernelMatch &m) {
+        return 5 + Pattern<A>::width(ts, m) + Pattern<B>::width(ts, m);  // "(+ a b)"
+    }
+    static TermId instantiate(TermStore &ts) {
+        TermId a = Pattern<A>::instantiate(ts);
+        TermId b = Pattern<B>::instantiate(ts);
+        return ts.make(OP, ts.symbols.intern(string(1, C)), 2, a, b);
+    }
+};
+
+typedef TermId (*RuleKernel)(bool &ok, TermStore &ts, const KernelSymbols &s, TermId node,
+                             VariableNameGenerator &var_gen, WidthBound bound);
+
+// The rule From -> To, with the contract of apply_transformation().
+template <typename From, typename To>
+TermId
+rewrite_kernel(bool &ok, TermStore &ts, const KernelSymbols &s, TermId node, VariableNameGenerator &var_gen,
+               WidthBound bound)
+{
+    KernelMatch m;
+    ok = Pattern<From>::match(ts, s, node, m);
+    if (!ok) return 0;
+    Pattern<To>::bind_fresh(ts, m, var_gen);
+    if (bound.limited() && !bound.allows(Pattern<To>::width(ts, m))) {
+        ok = false;
+        return NO_TERM;
+    }
+    return Pattern<To>::build(ts, s, m);
+}
+
+struct BuiltinAxiom {
+    const char *name;
+    RuleKernel forward, backward;
+    TermId (*left)(TermStore &), (*right)(TermStore &);
 };
 
+template <typename Left, typename Right>
+constexpr BuiltinAxiom
+builtin_axiom(const char *name)
+{
+    return { name, &rewrite_kernel<Left, Right>, &rewrite_kernel<Right, Left>,
+             &Pattern<Left>::instantiate, &Pattern<Right>::instantiate };
+}
+
+typedef PatVar<0> VarA;
+typedef PatVar<1> VarB;
+typedef PatVar<2> VarC;
+typedef PatPrim<'0'> Zero;
+typedef PatPrim<'1'> One;
+template <typename A, typename B> using Add = PatOp2<'+', A, B>;
+template <typename A, typename B> using Mul = PatOp2<'*', A, B>;
+template <typename A> using Neg = PatOp1<'~', A>;
+
+const BuiltinAxiom BUILTIN_AXIOMS[] = {
+    builtin_axiom<Add<VarA, Add<VarB, VarC>>, Add<Add<VarA, VarB>, VarC>>("ass_add"),
+    builtin_axiom<Mul<VarA, Mul<VarB, VarC>>, Mul<Mul<VarA, VarB>, VarC>>("ass_mul"),
+    builtin_axiom<Add<VarA, VarB>, Add<VarB, VarA>>("com_add"),
+    builtin_axiom<Mul<VarA, VarB>, Mul<VarB, VarA>>("com_mul"),
+    builtin_axiom<Add<VarA, Mul<VarA, VarB>>, VarA>("abs_add"),
+    builtin_axiom<Mul<VarA, Add<VarA, VarB>>, VarA>("abs_mul"),
+    builtin_axiom<Add<VarA, Zero>, VarA>("ide_add"),
+    builtin_axiom<Mul<VarA, One>, VarA>("ide_mul"),
+    builtin_axiom<Add<VarA, Mul<VarB, VarC>>, Mul<Add<VarA, VarB>, Add<VarA, VarC>>>("dis_add"),
+    builtin_axiom<Mul<VarA, Add<VarB, VarC>>, Add<Mul<VarA, VarB>, Mul<VarA, VarC>>>("dis_mul"),
+    builtin_axiom<Add<VarA, Neg<VarA>>, One>("inv_add"),
+    builtin_axiom<Mul<VarA, Neg<VarA>>, Zero>("inv_mul"),
+};
+
+const BuiltinAxiom *
+find_builtin_axiom(string_view name)
+{
+    for (const BuiltinAxiom &builtin : BUILTIN_AXIOMS) {
+        if (name == builtin.name) return &builtin;
+    }
+    return nullptr;
+}
+
+
+/*
+    Reads tokens from a stream one line at a time, so commands can be run
+    as soon as they are read and input of any length needs no more memory
+    than its longest line. Tokens are views into the current line and stay
+    valid until the tokenizer moves on to the next one; the column of a
+    token is just its offset in the line.
+
+    A syntax error is thrown as a ProverFailure when `fatal` is set.
+    Otherwise the first error is kept in error_text, `failed` is set, and
+    every later next() returns "" so the parse functions unwind without
+    reading on.
+*/
 class Tokenizer {
 public:
-    int idx, line_number, col;
-    string line, text;
-    Tokenizer(string _text) :
-        idx(0), line_number(0), col(0), line(""), text(_text) {
-            line = seek_line(idx);
+    int idx, line_number;
+    string line;
+    bool fatal, failed;
+    string error_text;
+    Tokenizer(istream &_in, bool _fatal = true) :
+        idx(0), line_number(-1), line(""), fatal(_fatal), failed(false), in(_in), eof(false) {
+            next_line();
         }
-    string next() {
+    string_view next() {
+        if (failed) return "";
 
         skip_whitespace_and_comments();
 
         // is it a single character token?
-        if (idx < (int)text.size()) {
-            char tok = text[idx];
-            if (is_single_char_token(tok)) {
-                idx++;
-                col++;
-                return {tok};
+        if (!eof) {
+            if (is_single_char_token(line[idx])) {
+                return token(idx, 1);
             }
         } else {
-            perror(line, "Unexpected end of statement.", line_number+1, col+1);
-            exit(1);
+            error("Unexpected end of statement.", column()+1);
+            return "";
         }
 
-        // is it a word token?
-        string word_tok;
-        if (idx < (int)text.size() && (isalnum(text[idx]) || text[idx] == '_')) {
-            word_tok.push_back(text[idx]);
-            idx++;
-            col++;
-
-            while (idx < (int)text.size() && (text[idx] == '_' || isalnum(text[idx]))) {
-                word_tok.push_back(text[idx]);
-                idx++;
-                col++;
+        // is it a string literal?
+        if (line[idx] == '"') {
+            size_t close = line.find('"', idx + 1);
+            if (close == string::npos) {
+                idx = (int)line.size();
+                error("Unterminated string.", column()+1);
+                return "";
             }
-            return word_tok;
+            return token(idx, (int)close + 1 - idx);
+        }
+
+        // is it a word token?
+        if (isalnum(line[idx]) || line[idx] == '_') {
+            int end = idx + 1;
+            while (end < (int)line.size() && (line[end] == '_' || isalnum(line[end]))) end++;
+            return token(idx, end - idx);
         }
 
-        perror(line, "Unexpected character.", line_number+1, col+1);
-        exit(1);
+        error("Unexpected character.", column()+1);
+        return "";
 
     }
+    int column() const {
+        return idx;
+    }
     void skip_whitespace() {
-        while (idx < (int)text.size() && isspace(text[idx])) {
-            if (text[idx] == '\n') {
+        while (!eof && (idx == (int)line.size() || isspace(line[idx]))) {
+            if (idx == (int)line.size()) {
                 // new line
-                idx++;
-                line_number++;
-                col = 0;
-                line = seek_line(idx);
+                next_line();
             } else {
                 idx++;
-                col++;
             }
         }
     }
@@ -177,11 +914,8 @@ public:
             skip_whitespace();
 
             // is it a comment?
-            if (idx < (int)text.size() && text[idx] == '#') {
-                while (idx < (int)text.size() && text[idx] != '\n') {
-                    idx++;
-                    col++;
-                }
+            if (!eof && line[idx] == '#') {
+                idx = (int)line.size();
             } else {
                 check_comment = false;
             }
@@ -190,14 +924,39 @@ public:
         skip_whitespace();
     }
     bool done() {
+        if (failed) return true;
         skip_whitespace_and_comments();
-        return idx == (int)text.size();
+        return eof;
+    }
+    void error(string msg, int column) {
+        if (fatal) {
+            string text = format_error(line, msg, line_number+1, column);
+            text.pop_back();  // the newline
+            throw ProverFailure{ ProverError::SYNTAX, text };
+        }
+        if (!failed) {
+            failed = true;
+            error_text = format_error(line, msg, line_number+1, column);
+        }
     }
 private:
-    string seek_line(int from) {
-        int line_end = from;
-        while (line_end < (int)text.size() && text[line_end] != '\n') line_end++;
-        return text.substr(from, line_end-from);
+    istream &in;
+    bool eof;
+    string pending;
+
+    string_view token(int from, int length) {
+        idx = from + length;
+        return string_view(line).substr(from, length);
+    }
+    void next_line() {
+        if (getline(in, pending)) {
+            line.swap(pending);
+            line_number++;
+            idx = 0;
+        } else {
+            // the last line stays around for error messages
+            eof = true;
+        }
     }
 };
 
@@ -206,7 +965,7 @@ Node
 parse_formula(Tokenizer &tokenizer)
 {
     Node node;
-    string tok = tokenizer.next();
+    string_view tok = tokenizer.next();
     if (tok == "(") {
         tok = tokenizer.next();
         if (is_uop_token(tok)) {
@@ -219,20 +978,14 @@ parse_formula(Tokenizer &tokenizer)
             node.children.push_back(parse_formula(tokenizer));
             node.children.push_back(parse_formula(tokenizer));
         } else {
-            perror(tokenizer.line,
-                   "Expected operator token.",
-                   tokenizer.line_number+1,
-                   tokenizer.col);
-            exit(1);
+            tokenizer.error("Expected operator token.", tokenizer.column());
+            return node;
         }
 
         tok = tokenizer.next();
         if (tok != ")") {
-            perror(tokenizer.line,
-                   "Expected closing parentheses",
-                   tokenizer.line_number+1,
-                   tokenizer.col);
-            exit(1);
+            tokenizer.error("Expected closing parentheses", tokenizer.column());
+            return node;
         }
 
     } else if (is_prim_token(tok)) {
@@ -244,75 +997,132 @@ parse_formula(Tokenizer &tokenizer)
         node.type = VAR;
 
     } else {
-        perror(tokenizer.line,
-               "Unexpected token.",
-               tokenizer.line_number+1,
-               tokenizer.col);
-        exit(1);
+        tokenizer.error("Unexpected token.", tokenizer.column());
+        return node;
+    }
+
+    return node;
+}
+
+/*
+    Parses a formula straight into interned terms, without building a Node
+    tree first. Symbols are interned before the next token is read, since
+    that may replace the line the current token points into.
+*/
+TermId
+parse_term(Tokenizer &tokenizer, TermStore &ts)
+{
+    string_view tok = tokenizer.next();
+    if (tok == "(") {
+        tok = tokenizer.next();
+        TermId term;
+        if (is_uop_token(tok)) {
+            Symbol sym = ts.symbols.intern(tok);
+            TermId a = parse_term(tokenizer, ts);
+            if (tokenizer.failed) return NO_TERM;
+            term = ts.make(OP, sym, 1, a);
+        } else if (is_bop_token(tok)) {
+            Symbol sym = ts.symbols.intern(tok);
+            TermId a = parse_term(tokenizer, ts);
+            TermId b = parse_term(tokenizer, ts);
+            if (tokenizer.failed) return NO_TERM;
+            term = ts.make(OP, sym, 2, a, b);
+        } else {
+            tokenizer.error("Expected operator token.", tokenizer.column());
+            return NO_TERM;
+        }
+
+        tok = tokenizer.next();
+        if (tok != ")") {
+            tokenizer.error("Expected closing parentheses", tokenizer.column());
+            return NO_TERM;
+        }
+        return term;
+
+    } else if (is_prim_token(tok)) {
+        return ts.make(PRIM, ts.symbols.intern(tok));
+
+    } else if (is_id_token(tok)) {
+        return ts.make(VAR, ts.symbols.intern(tok));
     }
 
+    tokenizer.error("Unexpected token.", tokenizer.column());
+    return NO_TERM;
+}
+
+// A formula of a command, as a Node tree or, given a store, already interned.
+Node
+parse_side(Tokenizer &tokenizer, TermStore *ts)
+{
+    if (!ts) return parse_formula(tokenizer);
+    Node node = { .token = "", .type = OP, .children = {} };
+    node.term = parse_term(tokenizer, *ts);
     return node;
 }
 
+// Whether the left side of an axiom is the bare word `builtin`.
+bool
+is_builtin_side(const Node &side, const TermStore *ts)
+{
+    if (!ts) return side.type == VAR && side.token == "builtin";
+    return side.term != NO_TERM && (*ts)[side.term].type == VAR && ts->symbols.name((*ts)[side.term].sym) == "builtin";
+}
+
 Node
-parse_command(Tokenizer &tokenizer)
+parse_command(Tokenizer &tokenizer, TermStore *ts = nullptr)
 {
     Node node;
-    string tok = tokenizer.next();
+    string_view tok = tokenizer.next();
     if (tok == "axiom") {
-        string name = tokenizer.next();
+        string name(tokenizer.next());
         if (!is_id_token(name)) {
-            perror(tokenizer.line,
-                   "Expected identifier.",
-                   tokenizer.line_number+1,
-                   tokenizer.col);
-            exit(1);
+            tokenizer.error("Expected identifier.", tokenizer.column());
+            return node;
         }
         node.token = name;
         node.type = AXIOM;
 
-        string colon = tokenizer.next();
+        string_view colon = tokenizer.next();
         if (colon != ":") {
-            perror(tokenizer.line,
-                   "Expected colon (:) in axiom definition.",
-                   tokenizer.line_number+1,
-                   tokenizer.col);
-            exit(1);
+            tokenizer.error("Expected colon (:) in axiom definition.", tokenizer.column());
+            return node;
         }
 
-        node.children.push_back(parse_formula(tokenizer));
+        Node left = parse_side(tokenizer, ts);
 
-        string eq = tokenizer.next();
+        string_view eq = tokenizer.next();
+        if (eq == "." && is_builtin_side(left, ts)) {
+            // a builtin axiom has no sides of its own, see make_axiom()
+            if (!find_builtin_axiom(node.token)) {
+                tokenizer.error("Unknown builtin axiom.", tokenizer.column());
+            }
+            return node;
+        }
         if (eq != "=") {
-            perror(tokenizer.line,
-                   "Expected '=' token.",
-                   tokenizer.line_number+1,
-                   tokenizer.col);
-            exit(1);
+            tokenizer.error("Expected '=' token.", tokenizer.column());
+            return node;
         }
 
-        node.children.push_back(parse_formula(tokenizer));
+        node.children.push_back(left);
+        node.children.push_back(parse_side(tokenizer, ts));
 
     } else if (tok == "prove") {
         node.token = "prove";
         node.type = PROVE;
-        node.children.push_back(parse_formula(tokenizer));
+        node.children.push_back(parse_side(tokenizer, ts));
 
-        string eq = tokenizer.next();
+        string_view eq = tokenizer.next();
         if (eq != "=") {
-            perror(tokenizer.line,
-                   "Expected '=' token.",
-                   tokenizer.line_number+1,
-                   tokenizer.col);
-            exit(1);
+            tokenizer.error("Expected '=' token.", tokenizer.column());
+            return node;
         }
 
-        node.children.push_back(parse_formula(tokenizer));
+        node.children.push_back(parse_side(tokenizer, ts));
 
     } else if (tok == "param") {
-        string param_name = tokenizer.next();
+        string param_name(tokenizer.next());
         if (is_pos_int_param_token(param_name)) {
-            string value = tokenizer.next();
+            string value(tokenizer.next());
 
             if (is_pos_int_token(value)) {
                 node.token = param_name;
@@ -325,15 +1135,12 @@ parse_command(Tokenizer &tokenizer)
                 node.children.push_back(child);
 
             } else {
-                perror(tokenizer.line,
-                    "Expected integer value for hyper parameter.",
-                    tokenizer.line_number+1,
-                    tokenizer.col);
-                exit(1);
+                tokenizer.error("Expected integer value for hyper parameter.", tokenizer.column());
+                return node;
             }
 
         } else if (is_bool_param_token(param_name)) {
-            string value = tokenizer.next();
+            string value(tokenizer.next());
 
             if (is_bool_token(value)) {
                 node.token = param_name;
@@ -346,37 +1153,80 @@ parse_command(Tokenizer &tokenizer)
                 node.children.push_back(child);
 
             } else {
-                perror(tokenizer.line,
-                    "Expected number value for hyper parameter.",
-                    tokenizer.line_number+1,
-                    tokenizer.col);
-                exit(1);
+                tokenizer.error("Expected number value for hyper parameter.", tokenizer.column());
+                return node;
             }
 
-        } else {
-            perror(tokenizer.line,
-                   "Expected either 'max_tree_size' or 'max_search_depth' hyper parameter.",
-                   tokenizer.line_number+1,
-                   tokenizer.col);
-            exit(1);
-        }
-
-    } else {
-        perror(tokenizer.line,
-               "Unexpected token. Command must either be 'axiom' or 'prove'",
-               tokenizer.line_number+1,
-               tokenizer.col);
-        exit(1);
-    }
-
-    string dot = tokenizer.next();
-    if (dot != ".") {
-        perror(tokenizer.line,
-               "Expected terminator (.) token.",
-               tokenizer.line_number+1,
-               tokenizer.col);
-        exit(1);
-    }
+        } else if (is_mode_param_token(param_name)) {
+            string value(tokenizer.next());
+
+            if (is_search_mode_token(value)) {
+                node.token = param_name;
+                node.type = PARAM;
+                Node child = {
+                    .token = value,
+                    .type = VAR,
+                    .children = {}
+                };
+                node.children.push_back(child);
+
+            } else {
+                tokenizer.error("Expected search mode ('bfs', 'bidirectional', 'ida_star', 'egraph' or 'best_first').",
+                                tokenizer.column());
+                return node;
+            }
+
+        } else if (is_orientation_param_token(param_name)) {
+            string value(tokenizer.next());
+
+            if (is_orientation_token(value)) {
+                node.token = param_name;
+                node.type = PARAM;
+                Node child = {
+                    .token = value,
+                    .type = VAR,
+                    .children = {}
+                };
+                node.children.push_back(child);
+
+            } else {
+                tokenizer.error("Expected lemma orientation ('both' or 'shrinking').", tokenizer.column());
+                return node;
+            }
+
+        } else if (is_string_param_token(param_name)) {
+            string value(tokenizer.next());
+
+            if (is_string_token(value)) {
+                node.token = param_name;
+                node.type = PARAM;
+                Node child = {
+                    .token = value.substr(1, value.size() - 2),
+                    .type = VAR,
+                    .children = {}
+                };
+                node.children.push_back(child);
+
+            } else {
+                tokenizer.error("Expected quoted string value for hyper parameter.", tokenizer.column());
+                return node;
+            }
+
+        } else {
+            tokenizer.error("Unknown hyper parameter.", tokenizer.column());
+            return node;
+        }
+
+    } else {
+        tokenizer.error("Unexpected token. Command must either be 'axiom' or 'prove'", tokenizer.column());
+        return node;
+    }
+
+    string_view dot = tokenizer.next();
+    if (dot != ".") {
+        tokenizer.error("Expected terminator (.) token.", tokenizer.column());
+        return node;
+    }
 
     return node;
 }
@@ -384,7 +1234,8 @@ parse_command(Tokenizer &tokenizer)
 Node
 parse(string text)
 {
-    auto t = Tokenizer(text);
+    istringstream in(text);
+    auto t = Tokenizer(in);
     Node root;
     root.token = "root";
     root.type = ROOT;
@@ -412,6 +1263,8 @@ to_string(Node node)
         return node.token;
     } else if (node.type == UNRES) {
         return node.token;
+    } else if (node.type == AXIOM && node.children.empty()) {
+        return "axiom " + node.token + " : builtin.";
     } else if (node.type == AXIOM) {
         string left = to_string(node.children[0]);
         string right = to_string(node.children[1]);
@@ -430,149 +1283,107 @@ to_string(Node node)
         }
         return ret;
     } else {
-        rerror("to_string(Node) :: Invalid node type");
-        exit(1);
+        throw_failure(ProverError::INTERNAL, "to_string(Node) :: Invalid node type");
     }
 }
 
-Node
-clone_tree(Node node)
-{
-    return parse(to_string(node));
-}
-
-
-set<string>
-get_variables(Node node)
+TermId
+intern_tree(TermStore &ts, const Node &node)
 {
-    set<string> variables;
-    if (node.type == OP) {
-        for (Node child : node.children) {
-            for(string var : get_variables(child)) {
-                variables.insert(var);
-            }
+    if (node.term != NO_TERM) {
+        return node.term;
+    } else if (node.type == OP) {
+        Symbol sym = ts.symbols.intern(node.token);
+        TermId a = intern_tree(ts, node.children[0]);
+        if (node.children.size() == 1) {
+            return ts.make(OP, sym, 1, a);
         }
-    } else if (node.type == PRIM) {
-        // pass
-    } else if (node.type == VAR || node.type == UNRES) {
-        variables.insert(node.token);
+        TermId b = intern_tree(ts, node.children[1]);
+        return ts.make(OP, sym, 2, a, b);
+    } else if (node.type == PRIM || node.type == VAR || node.type == UNRES) {
+        return ts.make_leaf(node.type, node.token);
     } else {
-        rerror("get_variables() :: unexpected node type.");
-        exit(1);
+        throw_failure(ProverError::INTERNAL, "intern_tree() :: unexpected node type.");
     }
-    return variables;
 }
 
 
-bool
-trees_have_same_structure(Node a, Node b)
-{
-    if (a.type == OP) if (b.type != OP) return false;
-    if (a.type == PRIM) if (b.type != PRIM) return false;
-    if (a.type == VAR) if (b.type != VAR && b.type != UNRES) return false;
-    if (a.type == UNRES) if (b.type != VAR && b.type != UNRES) return false;
-    if (a.children.size() != b.children.size()) return false;
-    for (int i = 0; i < (int)a.children.size(); i++) {
-        if (!trees_have_same_structure(a.children[i], b.children[i])) {
-            return false;
-        }
+// The axiom an `axiom` command defines, a builtin one if it has no sides.
+Axiom
+make_axiom(TermStore &ts, const Node &cmd)
+{
+    if (cmd.children.empty()) {
+        const BuiltinAxiom *builtin = find_builtin_axiom(cmd.token);
+        // the parser only lets known names through
+        return { .name = cmd.token, .rule_a = builtin->left(ts), .rule_b = builtin->right(ts),
+                 .builtin = builtin };
     }
-    return true;
+    return { .name = cmd.token,
+             .rule_a = intern_tree(ts, cmd.children[0]),
+             .rule_b = intern_tree(ts, cmd.children[1]) };
 }
 
 
-bool
-trees_resolvable(Node a, Node b, map<string, string> &resolutions)
-{
-    if (a.type == OP) {
-        if (b.type != OP) return false;
-        if (a.token != b.token) return false;
-    } else if (a.type == PRIM) {
-        if (b.type != PRIM) return false;
-        if (a.token != b.token) return false;
-    } else if (a.type == VAR) {
-        if (b.type == VAR) {
-            return a.token == b.token;
-        } else if (b.type == UNRES) {
-            if (resolutions.find(b.token) != resolutions.end()) {
-                return false;
-            } else {
-                resolutions[b.token] = a.token;
-            }
-        }
-    }
-    if (a.children.size() != b.children.size()) return false;
-    for (int i = 0; i < (int)a.children.size(); i++) {
-        if (!trees_resolvable(a.children[i], b.children[i], resolutions)) {
-            return false;
+string
+to_string(const TermStore &ts, TermId id)
+{
+    const Term &t = ts[id];
+    if (t.type == OP) {
+        if (t.arity == 1) {
+            return "(" + ts.symbols.name(t.sym) + " " + to_string(ts, t.children[0]) + ")";
+        } else {
+            string left = to_string(ts, t.children[0]);
+            string right = to_string(ts, t.children[1]);
+            return "(" + ts.symbols.name(t.sym) + " " + left + " " + right + ")";
         }
+    } else if (t.type == PRIM || t.type == VAR || t.type == UNRES) {
+        return ts.symbols.name(t.sym);
+    } else {
+        throw_failure(ProverError::INTERNAL, "to_string(TermId) :: Invalid term type");
     }
-    return true;
 }
 
 
-bool
-trees_resolvable(Node a, Node b)
+void
+get_variables(const TermStore &ts, TermId id, vector<Symbol> &variables)
 {
-    set<NodeType> allowed = {OP, VAR, PRIM, UNRES};
-    if (allowed.find(a.type) == allowed.end() || allowed.find(b.type) == allowed.end()) {
-        rerror("trees_have_equal_structure() :: unexpected node type.");
-        exit(1);
+    const Term &t = ts[id];
+    if (t.type == OP) {
+        for (int i = 0; i < t.arity; i++) {
+            get_variables(ts, t.children[i], variables);
+        }
+    } else if (t.type == PRIM) {
+        // pass
+    } else if (t.type == VAR || t.type == UNRES) {
+        if (find(variables.begin(), variables.end(), t.sym) == variables.end()) {
+            variables.push_back(t.sym);
+        }
+    } else {
+        throw_failure(ProverError::INTERNAL, "get_variables() :: unexpected term type.");
     }
-    map<string, string> resolutions;
-    return trees_resolvable(a, b, resolutions);
 }
 
 
-bool
-trees_equal(Node a, Node b, map<string, string> resolutions)
-{
-    if (a.type == OP) {
-        if (b.type == OP) {
-            return a.token == b.token;
-        } else {
-            return false;
-        }
-    } else if (a.type == PRIM) {
-        if (b.type == PRIM) {
-            return a.token == b.token;
-        } else {
-            return false;
-        }
-    } else if (a.type == VAR) {
-        if (b.type == VAR) {
-            return a.token == b.token;
-        } else if (b.type == UNRES) {
-            if (resolutions.find(b.token) != resolutions.end()) {
-                return a.token == resolutions[b.token];
-            } else {
-                resolutions[b.token] = a.token;
-            }
-        } else {
-            return false;
-        }
-    } else if (a.type == UNRES) {
-        if (b.type == VAR) {
-            if (resolutions.find(a.token) != resolutions.end()) {
-                return b.token == resolutions[a.token];
-            } else {
-                resolutions[a.token] = b.token;
-            }
-        } else if (b.type == UNRES) {
+/*
+    Bindings of rule variables to subterms. Rules have a handful of
+    variables, so a flat vector beats a map here.
+*/
+typedef vector<pair<Symbol, TermId>> Scope;
 
-        }
-    } else {
-        rerror("trees_equal() :: Unexpected node type.");
-        exit(1);
+const TermId *
+scope_find(const Scope &scope, Symbol var)
+{
+    for (const auto &pr : scope) {
+        if (pr.first == var) return &pr.second;
     }
+    return nullptr;
 }
 
 
 /*
-    If the rule applies at the given node, this will return the subtrees
-    that match the corresponding variables in the tree as a dictionary
-    of variable names to references to nodes in the original tree.
-    Otherwise, this returns None.
+    If the rule applies at the given node, this binds the subterms that
+    match the corresponding variables of the rule in `scope` and returns
+    true. Otherwise, this returns false.
 
     At each node in the subtree, use the following table:
     rule \ node  |    op          |  var/unres  |   prim
@@ -583,310 +1394,5422 @@ trees_equal(Node a, Node b, map<string, string> resolutions)
 
     *   The rules must also be checked recursively for all children.
     **  The rule can be applied iff all instances of this variable
-        in the scope of the rule are equivalent in the tree.
+        in the scope of the rule are bound to the same term. Since terms
+        are hash-consed, that is a plain id comparison.
 */
 bool
-get_rule_replacements(Node node, Node rule, map<string, Node> &scope)
+get_rule_replacements(const TermStore &ts, TermId node, TermId rule, Scope &scope)
 {
-    if (rule.type == OP) {
-        if (node.type != OP) {
-            return false;
-        }
-        if (rule.token != node.token) {
-            return false;
-        }
-    }
-
-    if (rule.type == PRIM) {
-        if (node.type != PRIM) {
-            return false;
-        }
-        if (rule.token != node.token) {
-            return false;
+    const Term &r = ts[rule];
+    if (r.type == VAR || r.type == UNRES) {
+        const TermId *bound = scope_find(scope, r.sym);
+        if (bound) {
+            return *bound == node;
         }
+        scope.push_back({r.sym, node});
+        return true;
     }
 
-    if (rule.type == VAR || rule.type == UNRES) {
-        if (scope.find(rule.token) != scope.end()) {
-            if (!trees_equal(scope[rule.token], node)) {
-                return false;
-            }
-        } else {
-            scope[rule.token] = node;
-        }
+    const Term &n = ts[node];
+    if (r.type != n.type || r.sym != n.sym || r.arity != n.arity) {
+        return false;
     }
-
-    if (rule.type == OP && node.type == OP) {
-        if (node.children.size() != rule.children.size()) {
+    for (int i = 0; i < r.arity; i++) {
+        if (!get_rule_replacements(ts, n.children[i], r.children[i], scope)) {
             return false;
         }
-        if (!get_rule_replacements(node.children[0], rule.children[0], scope)) {
-            return false;
-        }
-        if (node.children.size() == 2) {
-            if (!get_rule_replacements(node.children[1], rule.children[1], scope)) {
-                return false;
-            }
-        }
     }
-
     return true;
-
 }
 
 
-Node
-replace_variables(Node node, map<string, Node> &scope)
+// The width of replace_variables(ts, rule, scope), without building it.
+uint32_t
+replaced_width(const TermStore &ts, TermId rule, const Scope &scope)
 {
-    if (node.type == VAR) {
-        return scope[node.token];
-    } else if (node.type == PRIM) {
-        return node;
-    } else if (node.type == OP) {
-        for (int i = 0; i < (int)node.children.size(); i++) {
-            node.children[i] = replace_variables(node.children[i], scope);
-        }
-        return node;
-    } else {
-        rerror("replace_variables() :: unexpected node type.");
-        exit(1);
+    const Term &r = ts[rule];
+    if (r.type == VAR || r.type == UNRES) {
+        return ts[*scope_find(scope, r.sym)].width;
+    }
+    uint32_t width = r.width;
+    for (int i = 0; i < (int)r.arity; i++) {
+        width += replaced_width(ts, r.children[i], scope) - ts[r.children[i]].width;
     }
+    return width;
 }
 
 
-Node
-apply_transformation(bool &ok, Node node, Node rule_from, Node rule_to, VariableNameGenerator &var_gen)
+TermId
+replace_variables(TermStore &ts, TermId rule, const Scope &scope)
 {
-    map<string, Node> scope;
-    ok = get_rule_replacements(node, rule_from, scope);
-    if (!ok) return {};
-    for (string var : get_variables(rule_to)) {
-        if (scope.find(var) == scope.end()) {
-            // var is unused
-            Node replacement = {
-                .token = var_gen.next(),
-                .type = UNRES,
-                .children = {}
-            };
-            scope[var] = replacement;
-        }
+    Term r = ts[rule];
+    if (r.type == VAR || r.type == UNRES) {
+        return *scope_find(scope, r.sym);
+    } else if (r.type == PRIM) {
+        return rule;
+    } else if (r.type == OP) {
+        TermId a = replace_variables(ts, r.children[0], scope);
+        TermId b = r.arity == 2 ? replace_variables(ts, r.children[1], scope) : 0;
+        return ts.make(OP, r.sym, r.arity, a, b);
+    } else {
+        throw_failure(ProverError::INTERNAL, "replace_variables() :: unexpected term type.");
     }
-    return replace_variables(rule_to, scope);
 }
 
 
-vector<pair<string, Node>>
-possible_next_trees_for_rule(
-    Node node,
-    string rule_name,
-    Node rule_from,
-    Node rule_to,
-    VariableNameGenerator &var_gen
-) {
-    vector<pair<string, Node>> possible;
-    bool ok;
-    Node new_node = apply_transformation(ok, node, rule_from, rule_to, var_gen);
-    if (ok) {
-        possible.push_back({rule_name, new_node});
-    }
-    for (int i = 0; i < (int)node.children.size(); i++) {
-        vector<pair<string, Node>> child_possible = \
-            possible_next_trees_for_rule(node.children[i], rule_name, rule_from, rule_to, var_gen);
-        for (pair<string, Node> pr : child_possible) {
-            Node copy = node;
-            copy.children[i] = pr.second;
-            possible.push_back({
-                rule_name,
-                copy
-            });
-        }
+/*
+    Counters for `param stats true.`. The code that fills them is a
+    template on a bool Stats, and the instantiation for false, used when
+    the param is off, has every counter and timer compiled out. Phase times
+    include the cost of reading the clock, so very cheap phases (queue
+    operations) read high.
+*/
+struct SearchStats {
+    enum Phase { MATCH, SUBSTITUTE, HASH_CONS, VISITED, QUEUE, PHASES };
+
+    const char *engine = "bfs";  // what answered: an engine, "semantic" or "cache"
+    uint64_t nanoseconds[PHASES] = {};
+    uint64_t expanded = 0;      // states whose successors were generated
+    uint64_t generated = 0;     // successor terms built
+    uint64_t duplicates = 0;    // successors already visited
+    uint64_t cut_by_size = 0;   // states not expanded because of max_tree_size
+    uint64_t pruned_by_size = 0;  // successors never built because of it
+    uint64_t cut_by_depth = 0;  // ... and because of max_search_depth
+    vector<string> rule_names;  // one per rule, see RuleIndex
+    vector<uint64_t> fires;     // successors produced by each rule
+    vector<int> frontier;       // states reached at each depth
+
+    static const char *phase_name(int phase) {
+        static const char *NAMES[PHASES] = { "match", "substitute", "hash_cons", "visited", "queue" };
+        return NAMES[phase];
     }
-    return possible;
-}
+};
 
 
-vector<pair<string, Node>>
-possible_next_trees(vector<Axiom> axioms, Node node, VariableNameGenerator &var_gen)
-{
-    vector<pair<string, Node>> possible;
-    for (Axiom axiom : axioms) {
-        // try a -> b
-        auto poss = possible_next_trees_for_rule(node, axiom.name, axiom.rule_a, axiom.rule_b, var_gen);
-        for (auto pr : poss) {
-            possible.push_back(pr);
-        }
-        // try b -> a
-        poss = possible_next_trees_for_rule(node, axiom.name, axiom.rule_b, axiom.rule_a, var_gen);
-        for (auto pr : poss) {
-            possible.push_back(pr);
-        }
+// Adds the time until it goes out of scope to one phase of stats.
+template <bool Stats>
+class PhaseTimer {
+public:
+    PhaseTimer(SearchStats *, SearchStats::Phase) {}
+};
+
+template <>
+class PhaseTimer<true> {
+public:
+    PhaseTimer(SearchStats *_stats, SearchStats::Phase _phase)
+        : stats(_stats), phase(_phase), start(chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        auto elapsed = chrono::steady_clock::now() - start;
+        stats->nanoseconds[phase] += (uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
     }
-    return possible;
-}
+private:
+    SearchStats *stats;
+    SearchStats::Phase phase;
+    chrono::steady_clock::time_point start;
+};
 
 
-vector<pair<string, Node>>
-find_shortest_path(bool &ok, int &states, vector<Axiom> axioms, Node start, Node target, int max_depth=4, int max_tree_size=40)
+// Resident set size of the process in bytes, or 0 if unknown.
+size_t
+resident_bytes()
 {
-    queue<Node> Q;
-    set<string> vis;
-    map<string, pair<string, Node>> parent;
-    map<string, int> depth;
-    VariableNameGenerator var_gen = VariableNameGenerator();
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long pages = 0, resident = 0;
+    int fields = fscanf(f, "%lu %lu", &pages, &resident);
+    fclose(f);
+    return fields == 2 ? (size_t)resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
 
-    string hstart = to_string(start);
-    string htarget = to_string(target);
-    Q.push(start);
-    vis.insert(hstart);
-    states = 0;
 
-    while (!Q.empty()) {
-        states++;
-        Node u = Q.front();
-        Q.pop();
-        string hu = to_string(u);
+/*
+    The time and memory a goal may take (`param time_limit_ms`, `param
+    memory_limit_mb`, 0 for no limit) and its progress lines (`param
+    progress_ms`), which go to stderr so that they never mix with results.
+    Every engine asks spent() once per state it expands (egraph once per
+    class it matches, rule it applies and class it rebuilds), from any of
+    its threads, and gives up once it is true, keeping a proof only if it
+    has one already (best_first and egraph can). That costs one
+    read of the clock; the memory limit and progress lines are only looked
+    at every CHECK_MS, and whichever thread gets there first does it. The
+    memory limit is on the resident size of the whole process, as that is
+    what runs out, so goals running side by side share it.
+*/
+class SearchBudget {
+public:
+    enum Limit { NONE, TIME, MEMORY };
+    static const int CHECK_MS = 10;
 
-        if (hu == htarget) {
-            ok = true;
-            vector<pair<string, Node>> path;
-            Node cur = u;
-            string hcur = hu;
-            while (hcur != hstart) {
-                pair<string, Node> pr = parent[hcur];
-                path.push_back({pr.first, cur});
-                cur = pr.second;
-                hcur = to_string(pr.second);
-            }
-            reverse(path.begin(), path.end());
-            return path;
-        }
+    SearchBudget(int time_limit_ms, int memory_limit_mb, int _progress_ms, const string &_goal)
+        : goal(_goal), start(chrono::steady_clock::now()), memory_limit((size_t)memory_limit_mb << 20),
+          progress(chrono::milliseconds(_progress_ms)), next_progress(start + progress) {
+        deadline = time_limit_ms > 0 ? start + chrono::milliseconds(time_limit_ms)
+                                     : chrono::steady_clock::time_point::max();
+        active = time_limit_ms > 0 || memory_limit_mb > 0 || _progress_ms > 0;
+    }
 
-        if ((int)hu.size() > max_tree_size || depth[hu] >= max_depth) {
-            continue;
+    // Whether the search should stop, now at the given depth with states checked and frontier left.
+    bool spent(int depth, uint64_t states, uint64_t frontier) {
+        if (limit.load(memory_order_relaxed) != NONE) return true;
+        if (!active) return false;
+        auto now = chrono::steady_clock::now();
+        if (now >= deadline) {
+            stop(TIME, depth);
+            return true;
         }
-
-        for (pair<string, Node> pr : possible_next_trees(axioms, u, var_gen)) {
-            Node v = pr.second;
-            string hv = to_string(v);
-            if (vis.find(hv) == vis.end()) {
-                vis.insert(hv);
-                Q.push(v);
-                depth[hv] = depth[hu] + 1;
-                parent[hv] = {pr.first, u};
-            }
+        if (now.time_since_epoch().count() < next_check.load(memory_order_relaxed)) return false;
+        unique_lock<mutex> guard(lock, try_to_lock);
+        if (!guard.owns_lock()) return false;
+        next_check = (now + chrono::milliseconds(CHECK_MS)).time_since_epoch().count();
+        if (memory_limit > 0 && resident_bytes() > memory_limit) {
+            stop(MEMORY, depth);
+            return true;
+        }
+        if (progress.count() > 0 && now >= next_progress) {
+            next_progress = now + progress;
+            double seconds = chrono::duration<double>(now - start).count();
+            static mutex output;
+            lock_guard<mutex> out(output);
+            cerr << "Progress on " << goal << ": depth " << depth << ", " << states << " states ("
+                 << fixed << setprecision(0) << (seconds > 0 ? states / seconds : 0.0) << "/s), frontier "
+                 << frontier << ", " << setprecision(3) << seconds << " seconds." << endl;
         }
+        return false;
     }
 
-    ok = false;
-    return {};
-}
+    // Milliseconds left before the time limit, or -1 without one.
+    int64_t remaining_ms() const {
+        if (deadline == chrono::steady_clock::time_point::max()) return -1;
+        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+        return max<int64_t>(left.count(), 0);
+    }
 
+    // Which limit stopped the search, and where.
+    Limit exhausted() const { return limit; }
+    int depth() const { return stopped_depth; }
 
-Axiom
-search_axiom(vector<Axiom> axioms, string name)
-{
-    for (Axiom ax : axioms) {
-        if (ax.name == name) {
-            return ax;
+private:
+    string goal;
+    chrono::steady_clock::time_point start, deadline;
+    size_t memory_limit;
+    chrono::milliseconds progress;
+    chrono::steady_clock::time_point next_progress;  // under lock
+    bool active;
+    atomic<int64_t> next_check{0};  // clock ticks
+    atomic<Limit> limit{NONE};
+    atomic<int> stopped_depth{0};
+    mutex lock;
+
+    void stop(Limit why, int depth) {
+        Limit none = NONE;
+        // the first thread to notice tells where the search was
+        if (limit.compare_exchange_strong(none, why)) stopped_depth = depth;
+    }
+};
+
+
+template <bool Stats = false>
+TermId
+apply_transformation(
+    bool &ok,
+    TermStore &ts,
+    TermId node,
+    TermId rule_from,
+    TermId rule_to,
+    VariableNameGenerator &var_gen,
+    WidthBound bound = {},
+    SearchStats *stats = nullptr
+) {
+    Scope scope;
+    {
+        PhaseTimer<Stats> timer(stats, SearchStats::MATCH);
+        ok = get_rule_replacements(ts, node, rule_from, scope);
+    }
+    if (!ok) return 0;
+    PhaseTimer<Stats> timer(stats, SearchStats::SUBSTITUTE);
+    vector<Symbol> variables;
+    get_variables(ts, rule_to, variables);
+    for (Symbol var : variables) {
+        if (!scope_find(scope, var)) {
+            // var is unused
+            scope.push_back({var, ts.make_leaf(UNRES, var_gen.next())});
         }
     }
-    rerror("search_axiom() :: invalid axiom name.");
-    exit(1);
+    if (bound.limited() && !bound.allows(replaced_width(ts, rule_to, scope))) {
+        ok = false;
+        return NO_TERM;
+    }
+    return replace_variables(ts, rule_to, scope);
 }
 
 
-string
-read_file(string fname)
-{
-    ifstream f(fname);
-    stringstream buffer;
-    buffer << f.rdbuf();
-    return buffer.str();
-}
+/*
+    A rule is one direction of an axiom. Rules are compiled once into a
+    discrimination tree over the preorder symbol sequence of their left-hand
+    sides, where variables become wildcards that skip a whole subterm. Looking
+    a term up yields exactly the rules whose left-hand side has the same
+    symbols at the same places; only repeated variables are left for
+    get_rule_replacements() to check.
+*/
+struct Rule {
+    string name;
+    TermId from, to;
+    RuleKernel kernel;  // applies the rule in place of apply_transformation(), if set
+};
+
+/*
+    A term laid out flat for the rule index: one entry per subterm in
+    preorder, so the index of an entry is the position Successor and
+    apply_at() use, and the subterm at i ends at i + size. Building it is
+    one pass over the term; after that, walking the discrimination tree is
+    a scan over a contiguous array, where a wildcard skips a subterm by
+    adding its size rather than pushing and popping its children.
+*/
+class FlatTerm {
+public:
+    static const uint64_t WILDCARD = UINT64_MAX;
 
+    struct Entry {
+        uint64_t key;  // see key()
+        TermId id;
+        uint32_t size;
+    };
+    vector<Entry> entries;
 
-int main(int argc, char ** argv)
-{
-    if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " [filename]" << endl;
-        exit(1);
+    void assign(const TermStore &ts, TermId term) {
+        entries.clear();
+        entries.reserve(ts[term].size);
+        push(ts, term);
     }
 
-    // defaults
-    int max_search_depth = 8;
-    int max_tree_size = 20;
-    bool use_proofs_as_axioms = false;
+    // What the discrimination tree branches on: type, arity and symbol, or
+    // WILDCARD for a variable.
+    static uint64_t key(const Term &t) {
+        if (t.type == VAR || t.type == UNRES) return WILDCARD;
+        return ((uint64_t)t.type << 40) | ((uint64_t)t.arity << 32) | t.sym;
+    }
 
-    string code = read_file(argv[1]);
-    Node root = parse(code);
+private:
+    void push(const TermStore &ts, TermId id) {
+        const Term &t = ts[id];
+        entries.push_back({ key(t), id, t.size });
+        for (int i = 0; i < (int)t.arity; i++) push(ts, t.children[i]);
+    }
+};
 
-    vector<Axiom> axioms;
+class RuleIndex {
+public:
+    // rule 2i reads axiom i as a -> b, rule 2i+1 as b -> a
+    vector<Rule> rules;
 
-    for (Node cmd : root.children) {
-        if (cmd.type == PROVE) {
-            Node start = cmd.children[0];
-            Node target = cmd.children[1];
-            string start_string = to_string(start);
-            string target_string = to_string(target);
-            cout << "Prove " << to_string(start) << " = " << to_string(target) << "..." << endl;
-            bool ok;
-            int states;
-            auto st_clock = chrono::high_resolution_clock::now();
-            auto path = find_shortest_path(ok, states, axioms, start, target, max_search_depth, max_tree_size);
-            auto en_clock = chrono::high_resolution_clock::now();
-            auto elapsed = chrono::duration_cast<chrono::milliseconds>(en_clock - st_clock);
-            double elapsed_seconds = ((double)elapsed.count()) / 1000.0;
-            if (ok) {
+    KernelSymbols symbols;  // for the kernels of builtin axioms
 
-                if (0 == (int)path.size()) {
-                    cout << "Statements are the same." << endl;
-                } else {
-                    cout << start_string << endl;
-                    for (auto pr : path) {
-                        Node node = pr.second;
-                        string rule_name = pr.first;
-                        cout << " = " << to_string(node) << "  w/ " << rule_name << endl;
-                    }
-                    cout << "Done in " << setprecision(3) << fixed << elapsed_seconds
-                         << " seconds after checking " << states << " states." << endl;
-                }
+    RuleIndex(const TermStore &ts, const vector<Axiom> &axioms) : rules(), symbols(ts.symbols), nodes(1) {
+        for (const Axiom &axiom : axioms) add(ts, axiom);
+    }
 
-                if (use_proofs_as_axioms) {
-                    Axiom axiom = {
-                        .name = "proof of " + to_string(start) + " = " + to_string(target),
-                        .rule_a = start,
-                        .rule_b = target
-                    };
-                    axioms.push_back(axiom);
-                }
+    void add(const TermStore &ts, const Axiom &axiom) {
+        const BuiltinAxiom *builtin = axiom.builtin;
+        insert(ts, axiom.rule_a, (int)rules.size());
+        rules.push_back({ axiom.name, axiom.rule_a, axiom.rule_b, builtin ? builtin->forward : nullptr });
+        // an oriented axiom keeps its slot for b -> a, it just never matches
+        if (!axiom.oriented) insert(ts, axiom.rule_b, (int)rules.size());
+        rules.push_back({ axiom.name, axiom.rule_b, axiom.rule_a, builtin ? builtin->backward : nullptr });
+    }
 
-            } else {
-                cout << "No path found within " << max_search_depth
-                     << " steps after checking " << states << " states in "
-                     << setprecision(3) << fixed << elapsed_seconds << " seconds." << endl;
-            }
+    // Rules that could apply at the root of term, in ascending order.
+    void candidates(const TermStore &ts, TermId term, vector<int> &out) const {
+        FlatTerm flat;
+        flat.assign(ts, term);
+        candidates(flat, 0, out);
+    }
+    // ... and at the subterm at position i of flat.
+    void candidates(const FlatTerm &flat, uint32_t i, vector<int> &out) const {
+        out.clear();
+        retrieve(flat, 0, i, i + flat.entries[i].size, out);
+        sort(out.begin(), out.end());
+    }
 
-        } else if (cmd.type == AXIOM) {
-            Axiom axiom = {
-                .name = cmd.token,
-                .rule_a = cmd.children[0],
-                .rule_b = cmd.children[1]
-            };
-            axioms.push_back(axiom);
+private:
+    static const uint64_t WILDCARD = FlatTerm::WILDCARD;
 
-        } else if (cmd.type == PARAM) {
-            if (cmd.token == "max_search_depth") {
-                max_search_depth = stoi(cmd.children[0].token);
-            } else if (cmd.token == "max_tree_size") {
-                max_tree_size = stoi(cmd.children[0].token);
-            } else if (cmd.token == "use_proofs_as_axioms") {
-                use_proofs_as_axioms = cmd.children[0].token == "true";
-            } else {
-                rerror("main() :: unexpected parameter " + cmd.token);
-                exit(1);
+    struct DNode {
+        vector<pair<uint64_t, int>> edges;
+        int wildcard = -1;
+        vector<int> rules;
+    };
+
+    vector<DNode> nodes;
+
+    int child(int dn, uint64_t k) const {
+        if (k == WILDCARD) return nodes[dn].wildcard;
+        for (auto &edge : nodes[dn].edges) {
+            if (edge.first == k) return edge.second;
+        }
+        return -1;
+    }
+
+    void insert(const TermStore &ts, TermId pattern, int rule) {
+        int dn = 0;
+        vector<TermId> pending = { pattern };
+        while (!pending.empty()) {
+            const Term &t = ts[pending.back()];
+            pending.pop_back();
+            uint64_t k = FlatTerm::key(t);
+            int next = child(dn, k);
+            if (next < 0) {
+                next = (int)nodes.size();
+                if (k == WILDCARD) nodes[dn].wildcard = next;
+                else nodes[dn].edges.push_back({ k, next });
+                nodes.emplace_back();
+            }
+            dn = next;
+            if (k != WILDCARD) {
+                for (int i = t.arity - 1; i >= 0; i--) pending.push_back(t.children[i]);
             }
         }
+        nodes[dn].rules.push_back(rule);
+    }
+
+    // Matches the entries [i, end) of flat, which are whole subterms, from dn on.
+    void retrieve(const FlatTerm &flat, int dn, uint32_t i, uint32_t end, vector<int> &out) const {
+        if (i == end) {
+            out.insert(out.end(), nodes[dn].rules.begin(), nodes[dn].rules.end());
+            return;
+        }
+        const FlatTerm::Entry &e = flat.entries[i];
+        if (nodes[dn].wildcard >= 0) {
+            retrieve(flat, nodes[dn].wildcard, i + e.size, end, out);
+        }
+        // a variable of the term itself only matches a pattern variable
+        if (e.key == WILDCARD) return;
+        int next = child(dn, e.key);
+        if (next >= 0) {
+            retrieve(flat, next, i + 1, end, out);
+        }
+    }
+};
+
+
+/*
+    Rule r applied at the root of node, through its kernel if it has one.
+    Like apply_transformation(), ok is false if the rule does not apply,
+    and then the result is NO_TERM if it does but bound rules it out.
+*/
+template <bool Stats = false>
+TermId
+apply_rule(
+    bool &ok,
+    TermStore &ts,
+    const RuleIndex &index,
+    int r,
+    TermId node,
+    VariableNameGenerator &var_gen,
+    WidthBound bound = {},
+    SearchStats *stats = nullptr
+) {
+    const Rule &rule = index.rules[r];
+    if (rule.kernel) {
+        PhaseTimer<Stats> timer(stats, SearchStats::MATCH);
+        return rule.kernel(ok, ts, index.symbols, node, var_gen, bound);
     }
+    return apply_transformation<Stats>(ok, ts, node, rule.from, rule.to, var_gen, bound, stats);
+}
+
+
+/*
+    A successor of a state is described rather than built: the rule that
+    fires (axiom rule / 2, read backwards if rule is odd), the preorder
+    index of the subterm it rewrites, and the rewritten subterm itself.
+    The full term is only assembled by apply_at() once a search decides it
+    needs it; everything above the position is shared with the parent.
+*/
+struct Successor {
+    uint32_t position;
+    uint32_t rule;
+    TermId replacement;
+};
 
-    return 0;
-}
\ No newline at end of file
+
+/*
+    Successors of node, ordered by rule and then by position, which is the
+    order of trying each axiom a -> b and then b -> a at every subterm.
+    Successors whose width bound does not allow are left out.
+*/
+template <bool Stats = false>
+void
+possible_next_trees(
+    TermStore &ts,
+    const RuleIndex &index,
+    TermId node,
+    vector<Successor> &out,
+    WidthBound bound = {},
+    SearchStats *stats = nullptr
+) {
+    FlatTerm flat;
+    flat.assign(ts, node);
+    uint32_t fresh = ts[node].fresh;
+    uint32_t width = ts[node].width;
+    vector<int> candidates;
+    out.clear();
+    for (uint32_t position = 0; position < flat.entries.size(); position++) {
+        index.candidates(flat, position, candidates);
+        if (candidates.empty()) continue;
+        TermId sub = flat.entries[position].id;
+        WidthBound sub_bound = bound.inside(width, ts[sub].width);
+        for (int r : candidates) {
+            bool ok;
+            VariableNameGenerator var_gen(fresh);
+            TermId new_node = apply_rule<Stats>(ok, ts, index, r, sub, var_gen, sub_bound, stats);
+            if (ok) {
+                out.push_back({ position, (uint32_t)r, new_node });
+                if constexpr (Stats) stats->fires[r]++;
+            } else if constexpr (Stats) {
+                if (new_node == NO_TERM) stats->pruned_by_size++;
+            }
+        }
+    }
+    stable_sort(out.begin(), out.end(), [](const Successor &x, const Successor &y) {
+        return x.rule < y.rule;
+    });
+}
+
+
+/*
+    The term node with its subterm at preorder index position replaced.
+    Only the nodes on the path down to position are rebuilt, and make()
+    combines their hash, size and width from the cached values of their
+    children, so a successor costs the depth of the rewrite, not the size
+    of the term; its id is then all the visited sets need.
+*/
+TermId
+apply_at(TermStore &ts, TermId node, uint32_t position, TermId replacement)
+{
+    if (position == 0) {
+        return replacement;
+    }
+    const Term &t = ts[node];
+    TermId children[2] = { t.children[0], t.children[1] };
+    uint32_t left = ts[t.children[0]].size;
+    if (position <= left) {
+        children[0] = apply_at(ts, t.children[0], position - 1, replacement);
+    } else {
+        children[1] = apply_at(ts, t.children[1], position - 1 - left, replacement);
+    }
+    return ts.make(OP, t.sym, t.arity, children[0], children[1]);
+}
+
+
+/*
+    One visited state of a BFS, 12 bytes. The term itself is shared with
+    every other state through the hash-consed store, so a state only costs
+    this record, its slot in the visited set and the few nodes on the path
+    to the rewritten subterm. The depth takes one byte, which caps searches
+    at MAX_DEPTH steps.
+*/
+struct SearchState {
+    static const int MAX_DEPTH = 255;
+    static const uint32_t NO_RULE = (1u << 24) - 1;  // the root
+
+    TermId term;
+    uint32_t parent;
+    uint32_t depth : 8;
+    uint32_t rule : 24;
+
+    SearchState(TermId _term, uint32_t _parent, int _depth, uint32_t _rule)
+        : term(_term), parent(_parent), depth((uint32_t)_depth), rule(_rule) {}
+};
+static_assert(sizeof(SearchState) == 12);
+
+
+// Rewrite steps leading from the root state to nodes[idx], in order.
+vector<pair<string, TermId>>
+trace_path(const pmr::vector<SearchState> &nodes, uint32_t idx, const RuleIndex &rules)
+{
+    vector<pair<string, TermId>> path;
+    for (uint32_t cur = idx; nodes[cur].parent != TermIndex::NONE; cur = nodes[cur].parent) {
+        path.push_back({rules.rules[nodes[cur].rule].name, nodes[cur].term});
+    }
+    reverse(path.begin(), path.end());
+    return path;
+}
+
+
+// How many states the search reached at each depth, if levels is given.
+template <typename States>
+void
+count_levels(const States &nodes, vector<int> *levels)
+{
+    if (!levels) return;
+    levels->clear();
+    for (auto &node : nodes) {
+        if ((int)levels->size() <= node.depth) levels->resize(node.depth + 1);
+        (*levels)[node.depth]++;
+    }
+}
+
+
+template <bool Stats = false>
+vector<pair<string, TermId>>
+find_shortest_path(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    int max_depth=4,
+    int max_tree_size=40,
+    pmr::memory_resource *arena=pmr::get_default_resource(),
+    vector<int> *levels=nullptr,
+    SearchStats *stats=nullptr,
+    SearchBudget *budget=nullptr
+) {
+    if constexpr (Stats) {
+        stats->rule_names.clear();
+        for (const Rule &rule : rules.rules) stats->rule_names.push_back(rule.name);
+        stats->fires.assign(rules.rules.size(), 0);
+    }
+    // States are appended in the order they are reached, so `nodes` is
+    // the queue too and ui the index of its head; `vis` maps each visited
+    // term to its index, and the parent/depth bookkeeping lives in the
+    // state itself.
+    max_depth = min(max_depth, SearchState::MAX_DEPTH);
+    // a successor wider than max_tree_size would only be dequeued to be
+    // skipped, so it is not even built, unless it could be the target
+    WidthBound bound = { (uint32_t)max_tree_size, ts[target].width };
+    pmr::vector<SearchState> nodes(arena);
+    TermIndex vis(arena);
+    vector<Successor> successors;
+
+    nodes.push_back({ start, TermIndex::NONE, 0, SearchState::NO_RULE });
+    vis.insert(ts, start, 0);
+    states = 0;
+
+    for (uint32_t ui = 0; ui < nodes.size(); ui++) {
+        states++;
+        TermId u = nodes[ui].term;
+
+        if (u == target) {
+            count_levels(nodes, levels);
+            if constexpr (Stats) count_levels(nodes, &stats->frontier);
+            ok = true;
+            return trace_path(nodes, ui, rules);
+        }
+
+        if ((int)ts[u].width > max_tree_size) {
+            if constexpr (Stats) stats->cut_by_size++;
+            continue;
+        }
+        if (nodes[ui].depth >= max_depth) {
+            if constexpr (Stats) stats->cut_by_depth++;
+            continue;
+        }
+        if (budget && budget->spent(nodes[ui].depth, states, nodes.size() - ui)) {
+            ok = false;
+            return {};
+        }
+
+        possible_next_trees<Stats>(ts, rules, u, successors, bound, stats);
+        if constexpr (Stats) {
+            stats->expanded++;
+            stats->generated += successors.size();
+        }
+        for (const Successor &succ : successors) {
+            TermId v;
+            {
+                PhaseTimer<Stats> timer(stats, SearchStats::HASH_CONS);
+                v = apply_at(ts, u, succ.position, succ.replacement);
+            }
+            bool fresh;
+            {
+                PhaseTimer<Stats> timer(stats, SearchStats::VISITED);
+                fresh = vis.insert(ts, v, (uint32_t)nodes.size());
+            }
+            if (fresh) {
+                PhaseTimer<Stats> timer(stats, SearchStats::QUEUE);
+                nodes.push_back({ v, ui, nodes[ui].depth + 1, succ.rule });
+            } else if constexpr (Stats) {
+                stats->duplicates++;
+            }
+        }
+    }
+
+    count_levels(nodes, levels);
+    if constexpr (Stats) count_levels(nodes, &stats->frontier);
+    ok = false;
+    return {};
+}
+
+
+/*
+    Every axiom is an equation and successors are generated in both
+    directions, so a path from start to target read backwards is a path
+    from target to start. This grows one BFS tree from each end, always
+    expanding a whole level of the smaller frontier, and joins the two
+    halves at the shallowest state they have in common.
+*/
+struct SearchSide {
+    pmr::vector<SearchState> nodes;
+    TermIndex vis;
+    pmr::vector<uint32_t> frontier;
+    int depth;
+
+    SearchSide(pmr::memory_resource *mem) : nodes(mem), vis(mem), frontier(mem), depth(0) {}
+};
+
+
+vector<pair<string, TermId>>
+find_shortest_path_bidirectional(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    int max_depth=4,
+    int max_tree_size=40,
+    pmr::memory_resource *arena=pmr::get_default_resource(),
+    SearchBudget *budget=nullptr
+) {
+    max_depth = min(max_depth, SearchState::MAX_DEPTH);
+    SearchSide fwd(arena), bwd(arena);
+    vector<Successor> successors;
+    for (auto pr : {make_pair(&fwd, start), make_pair(&bwd, target)}) {
+        SearchSide &side = *pr.first;
+        side.nodes.push_back({ pr.second, TermIndex::NONE, 0, SearchState::NO_RULE });
+        side.vis.insert(ts, pr.second, 0);
+        side.frontier.push_back(0);
+        side.depth = 0;
+    }
+    states = 0;
+
+    if (start == target) {
+        ok = true;
+        return {};
+    }
+
+    while (!fwd.frontier.empty() && !bwd.frontier.empty() && fwd.depth + bwd.depth < max_depth) {
+        bool forward = fwd.frontier.size() <= bwd.frontier.size();
+        SearchSide &side = forward ? fwd : bwd;
+        SearchSide &other = forward ? bwd : fwd;
+
+        // meeting point with the shortest total length: (index in side, index in other)
+        pair<uint32_t, uint32_t> meet = { TermIndex::NONE, TermIndex::NONE };
+        pmr::vector<uint32_t> next(arena);
+        for (uint32_t ui : side.frontier) {
+            states++;
+            TermId u = side.nodes[ui].term;
+            if ((int)ts[u].width > max_tree_size) {
+                continue;
+            }
+            if (budget && budget->spent(fwd.depth + bwd.depth, states, side.frontier.size() + other.frontier.size())) {
+                ok = false;
+                return {};
+            }
+            possible_next_trees(ts, rules, u, successors);
+            for (const Successor &succ : successors) {
+                TermId v = apply_at(ts, u, succ.position, succ.replacement);
+                uint32_t vi = (uint32_t)side.nodes.size();
+                if (!side.vis.insert(ts, v, vi)) {
+                    continue;
+                }
+                side.nodes.push_back({ v, ui, side.depth + 1, succ.rule });
+                next.push_back(vi);
+                uint32_t oi = other.vis.find(ts, v);
+                if (oi != TermIndex::NONE &&
+                    (meet.second == TermIndex::NONE || other.nodes[oi].depth < other.nodes[meet.second].depth)) {
+                    meet = { vi, oi };
+                }
+            }
+        }
+        side.frontier.swap(next);
+        side.depth++;
+
+        if (meet.first != TermIndex::NONE) {
+            ok = true;
+            uint32_t fi = forward ? meet.first : meet.second;
+            uint32_t bi = forward ? meet.second : meet.first;
+            vector<pair<string, TermId>> path = trace_path(fwd.nodes, fi, rules);
+            // walking back up the target's tree undoes each backward step
+            for (uint32_t cur = bi; bwd.nodes[cur].parent != TermIndex::NONE; cur = bwd.nodes[cur].parent) {
+                path.push_back({rules.rules[bwd.nodes[cur].rule].name, bwd.nodes[bwd.nodes[cur].parent].term});
+            }
+            return path;
+        }
+    }
+
+    ok = false;
+    return {};
+}
+
+
+/*
+    AC normalization. When an operator has both a commutativity axiom
+    (op a b) = (op b a) and an associativity axiom
+    (op a (op b c)) = (op (op a b) c), every reordering and regrouping of
+    its operands is one state in the AC search: states are kept in a
+    canonical form where operand lists are flattened, sorted by term_less()
+    and rebuilt right-associated, and the two axioms themselves are not
+    applied. The printed proof puts back explicit commutation and
+    association steps.
+*/
+struct AcTheory {
+    // operator -> names of its commutativity and associativity axioms
+    map<Symbol, pair<string, string>> ops;
+    // rules that only reorder or regroup the operands of an AC operator
+    vector<bool> skip;
+
+    bool is_ac(Symbol op) const {
+        return ops.find(op) != ops.end();
+    }
+};
+
+
+bool
+is_distinct_vars(const TermStore &ts, vector<TermId> ids)
+{
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ts[ids[i]].type != VAR) return false;
+        for (size_t j = 0; j < i; j++) {
+            if (ids[i] == ids[j]) return false;
+        }
+    }
+    return true;
+}
+
+
+AcTheory
+find_ac_theory(const TermStore &ts, const RuleIndex &index)
+{
+    map<Symbol, pair<int, int>> found;  // op -> (commutativity rule, associativity rule)
+    for (size_t r = 0; r < index.rules.size(); r++) {
+        const Term &from = ts[index.rules[r].from];
+        const Term &to = ts[index.rules[r].to];
+        if (from.type != OP || from.arity != 2 || to.type != OP || to.sym != from.sym) continue;
+        const Term &fb = ts[from.children[1]];
+        const Term &ta = ts[to.children[0]];
+        // (op a b) -> (op b a)
+        if (is_distinct_vars(ts, { from.children[0], from.children[1] }) &&
+            to.children[0] == from.children[1] && to.children[1] == from.children[0]) {
+            found.insert({ from.sym, { -1, -1 } }).first->second.first = (int)r;
+        }
+        // (op a (op b c)) -> (op (op a b) c)
+        if (fb.type == OP && fb.sym == from.sym && fb.arity == 2 && ta.type == OP && ta.sym == from.sym &&
+            ta.arity == 2 && is_distinct_vars(ts, { from.children[0], fb.children[0], fb.children[1] }) &&
+            ta.children[0] == from.children[0] && ta.children[1] == fb.children[0] &&
+            to.children[1] == fb.children[1]) {
+            found.insert({ from.sym, { -1, -1 } }).first->second.second = (int)r;
+        }
+    }
+
+    AcTheory ac;
+    ac.skip.assign(index.rules.size(), false);
+    for (auto &pr : found) {
+        int comm = pr.second.first, assoc = pr.second.second;
+        if (comm < 0 || assoc < 0) continue;
+        ac.ops[pr.first] = { index.rules[comm].name, index.rules[assoc].name };
+        // rules come in pairs: 2i is a -> b and 2i+1 is b -> a
+        for (int r : { comm, comm ^ 1, assoc, assoc ^ 1 }) ac.skip[r] = true;
+    }
+    return ac;
+}
+
+
+// A total order on terms: by hash, then structurally on collisions.
+bool
+term_less(const TermStore &ts, TermId a, TermId b)
+{
+    if (a == b) return false;
+    const Term &x = ts[a], &y = ts[b];
+    if (x.hash != y.hash) return x.hash < y.hash;
+    if (x.type != y.type) return x.type < y.type;
+    if (x.sym != y.sym) return x.sym < y.sym;
+    if (x.arity != y.arity) return x.arity < y.arity;
+    for (int i = 0; i < x.arity; i++) {
+        if (x.children[i] != y.children[i]) return term_less(ts, x.children[i], y.children[i]);
+    }
+    return false;
+}
+
+
+// Operands of the maximal op-subterm rooted at id, left to right.
+void
+ac_operands(const TermStore &ts, Symbol op, TermId id, vector<TermId> &out)
+{
+    const Term &t = ts[id];
+    if (t.type == OP && t.sym == op && t.arity == 2) {
+        ac_operands(ts, op, t.children[0], out);
+        ac_operands(ts, op, t.children[1], out);
+    } else {
+        out.push_back(id);
+    }
+}
+
+
+// (op x1 (op x2 ... (op xn-1 xn))) over operands[from..]
+TermId
+ac_chain(TermStore &ts, Symbol op, const vector<TermId> &operands, size_t from = 0)
+{
+    TermId chain = operands.back();
+    for (size_t i = operands.size() - 1; i-- > from;) {
+        chain = ts.make(OP, op, 2, operands[i], chain);
+    }
+    return chain;
+}
+
+
+TermId
+ac_normalize(TermStore &ts, const AcTheory &ac, TermId id)
+{
+    Term t = ts[id];
+    if (t.type != OP) return id;
+    TermId children[2] = { 0, 0 };
+    for (int i = 0; i < t.arity; i++) {
+        children[i] = ac_normalize(ts, ac, t.children[i]);
+    }
+    if (t.arity != 2 || !ac.is_ac(t.sym)) {
+        return ts.make(OP, t.sym, t.arity, children[0], children[1]);
+    }
+    vector<TermId> operands;
+    ac_operands(ts, t.sym, children[0], operands);
+    ac_operands(ts, t.sym, children[1], operands);
+    sort(operands.begin(), operands.end(), [&ts](TermId a, TermId b) { return term_less(ts, a, b); });
+    return ac_chain(ts, t.sym, operands);
+}
+
+
+/*
+    Brings a term into AC normal form one commutation or association step
+    at a time, recording every intermediate term. Those steps only
+    rearrange a subterm in place, so the preorder positions of everything
+    outside it stay valid.
+*/
+class AcNormalizer {
+public:
+    AcNormalizer(TermStore &_ts, const AcTheory &_ac, TermId term) : ts(_ts), ac(_ac), cur(term) {}
+
+    vector<pair<string, TermId>> run() {
+        normalize(0);
+        return steps;
+    }
+
+private:
+    TermStore &ts;
+    const AcTheory &ac;
+    TermId cur;
+    vector<pair<string, TermId>> steps;
+
+    TermId at(uint32_t position) {
+        TermId id = cur;
+        while (position > 0) {
+            const Term &t = ts[id];
+            uint32_t left = ts[t.children[0]].size;
+            if (position <= left) {
+                id = t.children[0];
+                position -= 1;
+            } else {
+                id = t.children[1];
+                position -= 1 + left;
+            }
+        }
+        return id;
+    }
+    void step(const string &rule, uint32_t position, TermId replacement) {
+        cur = apply_at(ts, cur, position, replacement);
+        steps.push_back({ rule, cur });
+    }
+    // (op (op x y) z) -> (op x (op y z))
+    void rotate(Symbol op, uint32_t position) {
+        const Term &t = ts[at(position)];
+        const Term &l = ts[t.children[0]];
+        TermId x = l.children[0], y = l.children[1], z = t.children[1];
+        step(ac.ops.at(op).second, position, ts.make(OP, op, 2, x, ts.make(OP, op, 2, y, z)));
+    }
+    // (op x y) -> (op y x)
+    void commute(Symbol op, uint32_t position) {
+        const Term &t = ts[at(position)];
+        step(ac.ops.at(op).first, position, ts.make(OP, op, 2, t.children[1], t.children[0]));
+    }
+
+    void normalize(uint32_t position) {
+        Term t = ts[at(position)];
+        if (t.type != OP) return;
+        normalize(position + 1);
+        if (t.arity == 2) {
+            normalize(position + 1 + ts[ts[at(position)].children[0]].size);
+        }
+        if (t.arity != 2 || !ac.is_ac(t.sym)) return;
+        Symbol op = t.sym;
+
+        // right-associate the operand chain
+        for (uint32_t q = position;;) {
+            const Term &node = ts[at(q)];
+            const Term &left = ts[node.children[0]];
+            if (left.type == OP && left.sym == op && left.arity == 2) {
+                rotate(op, q);
+                continue;
+            }
+            const Term &right = ts[node.children[1]];
+            if (!(right.type == OP && right.sym == op && right.arity == 2)) break;
+            q += 1 + left.size;
+        }
+
+        // bubble sort the operands with adjacent swaps
+        bool swapped = true;
+        while (swapped) {
+            swapped = false;
+            for (uint32_t q = position;;) {
+                const Term &node = ts[at(q)];
+                TermId x = node.children[0];
+                const Term &rest = ts[node.children[1]];
+                bool last = !(rest.type == OP && rest.sym == op && rest.arity == 2);
+                TermId y = last ? node.children[1] : rest.children[0];
+                if (term_less(ts, y, x)) {
+                    swapped = true;
+                    if (last) {
+                        commute(op, q);
+                    } else {
+                        // (op x (op y r)) -> (op (op x y) r) -> (op (op y x) r) -> (op y (op x r))
+                        TermId r = rest.children[1];
+                        step(ac.ops.at(op).second, q, ts.make(OP, op, 2, ts.make(OP, op, 2, x, y), r));
+                        commute(op, q + 1);
+                        rotate(op, q);
+                    }
+                }
+                if (last) break;
+                q += 1 + ts[ts[at(q)].children[0]].size;
+            }
+        }
+    }
+};
+
+
+// Explicit commutation/association steps rewriting from into the AC-equal to.
+vector<pair<string, TermId>>
+ac_steps(TermStore &ts, const AcTheory &ac, TermId from, TermId to)
+{
+    vector<pair<string, TermId>> forward = AcNormalizer(ts, ac, from).run();
+    vector<pair<string, TermId>> backward = AcNormalizer(ts, ac, to).run();
+    // walk `to`'s normalization backwards: undoing its step k lands on the
+    // term before it
+    for (size_t k = backward.size(); k-- > 0;) {
+        forward.push_back({ backward[k].first, k > 0 ? backward[k - 1].second : to });
+    }
+    // the two halves may pass through the same term; cut out the detours
+    vector<pair<string, TermId>> steps;
+    for (auto &pr : forward) {
+        steps.push_back(pr);
+        for (size_t i = 0; i + 1 < steps.size(); i++) {
+            if (steps[i].second == pr.second) {
+                steps.resize(i + 1);
+                break;
+            }
+        }
+        if (pr.second == from) steps.clear();
+    }
+    return steps;
+}
+
+
+/*
+    One rewrite found in AC mode: `rule` turns `pre` into `post`, where pre
+    is an AC-equal rearrangement of the state's canonical term.
+*/
+struct AcRewrite {
+    uint32_t rule;
+    TermId pre, post;
+};
+
+
+void
+ac_rewrites_at_root(
+    TermStore &ts,
+    const RuleIndex &index,
+    const AcTheory &ac,
+    TermId node,
+    uint32_t fresh,
+    vector<int> &candidates,
+    vector<pair<uint32_t, TermId>> &out
+) {
+    index.candidates(ts, node, candidates);
+    for (int r : candidates) {
+        if (ac.skip[r]) continue;
+        bool ok;
+        VariableNameGenerator var_gen(fresh);
+        TermId new_node = apply_rule(ok, ts, index, r, node, var_gen);
+        if (ok) out.push_back({ (uint32_t)r, new_node });
+    }
+}
+
+
+/*
+    Rewrites of a canonical term u modulo AC. Besides matching every
+    subterm as it stands, an AC subterm with operands x1..xn is also matched
+    in the arrangements (op xi rest), (op rest xi) and (op (op xi xj) rest),
+    the pair (op xi xj) included, which lets a binary pattern pick its
+    operands out of the list. This does not cover patterns that need a
+    sub-multiset of two or more operands in one argument, beyond "the rest".
+*/
+void
+ac_successors(TermStore &ts, const RuleIndex &index, const AcTheory &ac, TermId u, vector<AcRewrite> &out)
+{
+    out.clear();
+    vector<Successor> plain;
+    possible_next_trees(ts, index, u, plain);
+    for (const Successor &succ : plain) {
+        if (ac.skip[succ.rule]) continue;
+        out.push_back({ succ.rule, u, apply_at(ts, u, succ.position, succ.replacement) });
+    }
+
+    uint32_t fresh = ts[u].fresh;
+    vector<int> candidates;
+    vector<pair<uint32_t, TermId>> found;
+    vector<pair<uint32_t, TermId>> stack = { { 0, u } };  // (position, subterm), preorder
+    while (!stack.empty()) {
+        auto [position, id] = stack.back();
+        stack.pop_back();
+        Term t = ts[id];
+        if (t.arity == 2) stack.push_back({ position + 1 + ts[t.children[0]].size, t.children[1] });
+        if (t.arity >= 1) stack.push_back({ position + 1, t.children[0] });
+        if (t.type != OP || t.arity != 2 || !ac.is_ac(t.sym)) continue;
+
+        vector<TermId> xs;
+        ac_operands(ts, t.sym, id, xs);
+        size_t n = xs.size();
+        // (arrangement, position of the pair inside it, or 0)
+        vector<pair<TermId, uint32_t>> arrangements;
+        for (size_t i = 0; i < n; i++) {
+            vector<TermId> rest;
+            for (size_t k = 0; k < n; k++) {
+                if (k != i) rest.push_back(xs[k]);
+            }
+            TermId r = ac_chain(ts, t.sym, rest);
+            arrangements.push_back({ ts.make(OP, t.sym, 2, xs[i], r), 0 });
+            arrangements.push_back({ ts.make(OP, t.sym, 2, r, xs[i]), 0 });
+            for (size_t j = 0; j < n && n >= 3; j++) {
+                if (j == i) continue;
+                vector<TermId> others;
+                for (size_t k = 0; k < n; k++) {
+                    if (k != i && k != j) others.push_back(xs[k]);
+                }
+                TermId pair_term = ts.make(OP, t.sym, 2, xs[i], xs[j]);
+                arrangements.push_back({ ts.make(OP, t.sym, 2, pair_term, ac_chain(ts, t.sym, others)), 1 });
+            }
+        }
+        sort(arrangements.begin(), arrangements.end());
+        arrangements.erase(unique(arrangements.begin(), arrangements.end()), arrangements.end());
+
+        for (auto &arr : arrangements) {
+            if (arr.first == id) continue;  // matched as it stands above
+            TermId pre = apply_at(ts, u, position, arr.first);
+            found.clear();
+            ac_rewrites_at_root(ts, index, ac, arr.first, fresh, candidates, found);
+            for (auto &f : found) {
+                out.push_back({ f.first, pre, apply_at(ts, pre, position, f.second) });
+            }
+            if (arr.second) {
+                TermId pair_term = ts[arr.first].children[0];
+                found.clear();
+                ac_rewrites_at_root(ts, index, ac, pair_term, fresh, candidates, found);
+                for (auto &f : found) {
+                    out.push_back({ f.first, pre, apply_at(ts, pre, position + 1, f.second) });
+                }
+            }
+        }
+    }
+}
+
+
+struct AcState {
+    TermId term;  // canonical
+    uint32_t parent;
+    int depth;
+    AcRewrite step;
+};
+
+
+/*
+    BFS over AC-canonical states. The path is rebuilt from the rewrites
+    that connect them, with explicit commutation and association steps
+    between one rewrite's result and the rearrangement the next one was
+    matched in.
+*/
+vector<pair<string, TermId>>
+find_shortest_path_ac(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    int max_depth=4,
+    int max_tree_size=40,
+    pmr::memory_resource *arena=pmr::get_default_resource(),
+    vector<int> *levels=nullptr,
+    SearchBudget *budget=nullptr
+) {
+    AcTheory ac = find_ac_theory(ts, rules);
+    TermId canonical_target = ac_normalize(ts, ac, target);
+    // nodes is the queue as well, see find_shortest_path()
+    pmr::vector<AcState> nodes(arena);
+    TermIndex vis(arena);
+    vector<AcRewrite> successors;
+
+    TermId canonical_start = ac_normalize(ts, ac, start);
+    nodes.push_back({ canonical_start, TermIndex::NONE, 0, { 0, start, start } });
+    vis.insert(ts, canonical_start, 0);
+    states = 0;
+
+    for (uint32_t ui = 0; ui < nodes.size(); ui++) {
+        states++;
+        TermId u = nodes[ui].term;
+
+        if (u == canonical_target) {
+            count_levels(nodes, levels);
+            ok = true;
+            vector<uint32_t> chain;
+            for (uint32_t cur = ui; nodes[cur].parent != TermIndex::NONE; cur = nodes[cur].parent) {
+                chain.push_back(cur);
+            }
+            reverse(chain.begin(), chain.end());
+            vector<pair<string, TermId>> path;
+            TermId cur = start;
+            for (uint32_t si : chain) {
+                const AcRewrite &step = nodes[si].step;
+                for (auto &pr : ac_steps(ts, ac, cur, step.pre)) path.push_back(pr);
+                path.push_back({ rules.rules[step.rule].name, step.post });
+                cur = step.post;
+            }
+            for (auto &pr : ac_steps(ts, ac, cur, target)) path.push_back(pr);
+            return path;
+        }
+
+        if ((int)ts[u].width > max_tree_size || nodes[ui].depth >= max_depth) {
+            continue;
+        }
+        if (budget && budget->spent(nodes[ui].depth, states, nodes.size() - ui)) {
+            ok = false;
+            return {};
+        }
+
+        ac_successors(ts, rules, ac, u, successors);
+        for (const AcRewrite &rw : successors) {
+            TermId v = ac_normalize(ts, ac, rw.post);
+            if (vis.insert(ts, v, (uint32_t)nodes.size())) {
+                nodes.push_back({ v, ui, nodes[ui].depth + 1, rw });
+            }
+        }
+    }
+
+    count_levels(nodes, levels);
+    ok = false;
+    return {};
+}
+
+
+/*
+    Admissible lower bound on the number of rewrites from a term to the
+    target, from how far apart their symbol multisets are.
+
+    A rule whose variables occur equally often on both sides changes the
+    symbol counts of any term it rewrites by a fixed amount: the counts of
+    its right-hand side constants minus those of its left-hand side. So the
+    L1 distance between symbol counts (and each symbol's own difference)
+    shrinks by at most the largest such change per step. A rule that drops
+    or copies a variable can move any count by any amount; with one of
+    those in the set, as in every axiom set the prover ships with (the
+    absorption, inverse and distribution laws), the counts bound nothing.
+
+    Whatever the rules, a term is also at least 2 rewrites away unless one
+    rewrite reaches the target. One rewrite at position p leaves the term
+    outside p as it is, so it can only reach the target at the positions
+    on the way down to where the two differ, and there rule.from must
+    match the term and rule.to the target under the same bindings. The
+    variables only rule.to has are let match anything, which can only
+    make the bound lower.
+*/
+class SymbolDistance {
+public:
+    static const int UNREACHABLE = INT_MAX / 2;
+
+    SymbolDistance(const TermStore &ts, const RuleIndex &_index, TermId _target)
+        : index(_index), target(_target), bounded(true), step(0) {
+        count_symbols(ts, target, target_counts, 1);
+        for (const Rule &rule : index.rules) {
+            map<Symbol, int> vars, delta;
+            count_variables(ts, rule.from, vars, -1);
+            count_variables(ts, rule.to, vars, 1);
+            for (auto &pr : vars) {
+                if (pr.second != 0) bounded = false;
+            }
+            count_constants(ts, rule.from, delta, -1);
+            count_constants(ts, rule.to, delta, 1);
+            int l1 = 0;
+            for (auto &pr : delta) {
+                l1 += abs(pr.second);
+                step_of[pr.first] = max(step_of[pr.first], abs(pr.second));
+            }
+            step = max(step, l1);
+        }
+    }
+
+    int operator()(const TermStore &ts, TermId term) const {
+        if (term == target) return 0;
+        int h = one_rewrite(ts, term, target) ? 1 : 2;
+        if (!bounded) return h;
+        map<Symbol, int> diff = target_counts;
+        count_symbols(ts, term, diff, -1);
+        int total = 0;
+        for (auto &pr : diff) {
+            if (pr.second == 0) continue;
+            int d = abs(pr.second);
+            auto it = step_of.find(pr.first);
+            if (it == step_of.end() || it->second == 0) return UNREACHABLE;
+            h = max(h, (d + it->second - 1) / it->second);
+            total += d;
+        }
+        if (total > 0) h = max(h, (total + step - 1) / step);
+        return h;
+    }
+
+private:
+    const RuleIndex &index;
+    TermId target;
+    bool bounded;
+    int step;                      // largest L1 change of one rewrite
+    map<Symbol, int> step_of;      // largest change of one symbol's count
+    map<Symbol, int> target_counts;
+
+    // Whether some rule could rewrite term into goal in one step, by the test above.
+    bool one_rewrite(const TermStore &ts, TermId term, TermId goal) const {
+        for (const Rule &rule : index.rules) {
+            Scope scope;
+            if (get_rule_replacements(ts, term, rule.from, scope) && get_rule_replacements(ts, goal, rule.to, scope)) {
+                return true;
+            }
+        }
+        // below the root, only if the two differ in a single child
+        const Term &t = ts[term], &g = ts[goal];
+        if (t.type != g.type || t.sym != g.sym || t.arity != g.arity) return false;
+        int differing = -1;
+        for (int i = 0; i < (int)t.arity; i++) {
+            if (t.children[i] == g.children[i]) continue;
+            if (differing >= 0) return false;
+            differing = i;
+        }
+        return differing >= 0 && one_rewrite(ts, t.children[differing], g.children[differing]);
+    }
+
+    static void count_symbols(const TermStore &ts, TermId id, map<Symbol, int> &counts, int sign) {
+        const Term &t = ts[id];
+        counts[t.sym] += sign;
+        for (int i = 0; i < t.arity; i++) count_symbols(ts, t.children[i], counts, sign);
+    }
+    static void count_constants(const TermStore &ts, TermId id, map<Symbol, int> &counts, int sign) {
+        const Term &t = ts[id];
+        if (t.type == OP || t.type == PRIM) counts[t.sym] += sign;
+        for (int i = 0; i < t.arity; i++) count_constants(ts, t.children[i], counts, sign);
+    }
+    static void count_variables(const TermStore &ts, TermId id, map<Symbol, int> &counts, int sign) {
+        const Term &t = ts[id];
+        if (t.type == VAR || t.type == UNRES) counts[t.sym] += sign;
+        for (int i = 0; i < t.arity; i++) count_variables(ts, t.children[i], counts, sign);
+    }
+};
+
+
+/*
+    Iterative-deepening A*: repeated depth-first searches that cut off at
+    g + h > bound, raising the bound to the smallest f that was cut off.
+    Children are tried in order of increasing h. The only bookkeeping
+    is the current path, so memory is linear in the depth; the terms an
+    iteration builds go into an overlay of `ts` that is dropped before
+    the next one, which is why `ts` must not itself be an overlay.
+
+    It is only as good as SymbolDistance. Under rules that drop or copy
+    variables, h is 1 or 2: it tells the terms one rewrite from the
+    target from the rest, which tries those first and spares expanding
+    most of the last level of each iteration, but orders nothing above
+    it. The search then degenerates towards iterative deepening, which
+    re-expands the levels above every iteration.
+*/
+class IdaStar {
+public:
+    IdaStar(const RuleIndex &_rules, TermId _start, TermId _target, const SymbolDistance &_h, int _max_depth,
+            int _max_tree_size, SearchBudget *_budget)
+        : rules(_rules), start(_start), target(_target), h(_h), max_depth(_max_depth),
+          max_tree_size(_max_tree_size), states(0), budget(_budget) {}
+
+    // FOUND, SPENT when the budget ran out, or the smallest f above bound seen under u
+    int search(TermStore &ts, TermId u, int g, int hu, int bound) {
+        states++;
+        int f = g + hu;
+        if (f > bound) return f;
+        if (u == target) return FOUND;
+        if (g >= max_depth || (int)ts[u].width > max_tree_size) return SymbolDistance::UNREACHABLE;
+        // the frontier of a depth-first search is the path it is on
+        if (budget && budget->spent(g, states, path.size())) return SPENT;
+
+        vector<Successor> successors;
+        possible_next_trees(ts, rules, u, successors, { (uint32_t)max_tree_size, ts[target].width });
+        // (h, rule, term), stable in generation order for equal h
+        vector<tuple<int, uint32_t, TermId>> children;
+        for (const Successor &succ : successors) {
+            TermId v = apply_at(ts, u, succ.position, succ.replacement);
+            if (v == u || v == start ||
+                find_if(path.begin(), path.end(), [v](auto &st) { return st.second == v; }) != path.end()) {
+                continue;
+            }
+            children.push_back({ h(ts, v), succ.rule, v });
+        }
+        stable_sort(children.begin(), children.end(), [](auto &x, auto &y) {
+            return get<0>(x) < get<0>(y);
+        });
+
+        int next_bound = SymbolDistance::UNREACHABLE;
+        for (auto &child : children) {
+            path.push_back({ (int)get<1>(child), get<2>(child) });
+            int r = search(ts, get<2>(child), g + 1, get<0>(child), bound);
+            if (r == FOUND || r == SPENT) return r;
+            next_bound = min(next_bound, r);
+            path.pop_back();
+        }
+        return next_bound;
+    }
+
+    static const int FOUND = -1;
+    static const int SPENT = -2;
+
+    const RuleIndex &rules;
+    TermId start, target;
+    const SymbolDistance &h;
+    int max_depth, max_tree_size;
+    int states;
+    vector<pair<int, TermId>> path;  // (rule, term) below the start
+    SearchBudget *budget;
+};
+
+
+vector<pair<string, TermId>>
+find_shortest_path_ida_star(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    int max_depth=4,
+    int max_tree_size=40,
+    SearchBudget *budget=nullptr
+) {
+    SymbolDistance h(ts, rules, target);
+    IdaStar ida(rules, start, target, h, max_depth, max_tree_size, budget);
+    int bound = h(ts, start);
+    ok = false;
+
+    while (bound <= max_depth) {
+        TermStore iteration(&ts);
+        int r = ida.search(iteration, start, 0, h(iteration, start), bound);
+        if (r == IdaStar::FOUND) {
+            ok = true;
+            vector<pair<string, TermId>> path;
+            for (auto &step : ida.path) {
+                path.push_back({ rules.rules[step.first].name, copy_term(ts, iteration, step.second) });
+            }
+            states = ida.states;
+            return path;
+        }
+        if (r == IdaStar::SPENT) break;
+        bound = r;
+    }
+
+    states = ida.states;
+    return {};
+}
+
+
+/*
+    Fixed set of worker threads running submitted tasks in FIFO order.
+    parallel_for() also runs the loop on the calling thread and waits only
+    for helpers that actually started, so it is safe to call from inside a
+    task even when every worker is busy.
+*/
+class ThreadPool {
+public:
+    explicit ThreadPool(int n) : stopping(false) {
+        for (int i = 0; i < n; i++) {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (thread &t : workers) t.join();
+    }
+    int size() const {
+        return (int)workers.size();
+    }
+    void submit(function<void()> task) {
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push(move(task));
+        }
+        cv.notify_one();
+    }
+    void parallel_for(size_t n, const function<void(size_t)> &fn, size_t chunk = 16) {
+        struct Loop {
+            atomic<size_t> next{0};
+            mutex lock;
+            condition_variable cv;
+            bool closed = false;
+            int running = 0;
+        };
+        auto loop = make_shared<Loop>();
+        auto body = [loop, n, chunk, &fn] {
+            size_t i;
+            while ((i = loop->next.fetch_add(chunk)) < n) {
+                for (size_t k = i; k < min(i + chunk, n); k++) fn(k);
+            }
+        };
+        for (int w = 0; w < size(); w++) {
+            submit([loop, body] {
+                {
+                    lock_guard<mutex> guard(loop->lock);
+                    if (loop->closed) return;
+                    loop->running++;
+                }
+                body();
+                lock_guard<mutex> guard(loop->lock);
+                if (--loop->running == 0) loop->cv.notify_all();
+            });
+        }
+        body();
+        unique_lock<mutex> guard(loop->lock);
+        loop->closed = true;
+        loop->cv.wait(guard, [&] { return loop->running == 0; });
+    }
+
+private:
+    vector<thread> workers;
+    queue<function<void()>> tasks;
+    mutex lock;
+    condition_variable cv;
+    bool stopping;
+
+    void run() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> guard(lock);
+                cv.wait(guard, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+};
+
+
+/*
+    Serializes allocations from several threads into a resource that is
+    not thread-safe itself, such as a per-proof monotonic arena.
+*/
+class LockedResource : public pmr::memory_resource {
+public:
+    explicit LockedResource(pmr::memory_resource *_upstream) : upstream(_upstream) {}
+
+private:
+    pmr::memory_resource *upstream;
+    mutex lock;
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        lock_guard<mutex> guard(lock);
+        return upstream->allocate(bytes, alignment);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        lock_guard<mutex> guard(lock);
+        upstream->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+
+/*
+    Sharded visited table for the parallel search. A term maps either to
+    the index of its settled state, or, while the level that generated it
+    is being expanded, to the smallest (frontier position, successor rank)
+    it was generated at. Keeping the minimum makes the winner the same as
+    the first-come winner of the serial search, whatever the scheduling.
+*/
+class ClaimTable {
+public:
+    static const uint64_t SETTLED = 1ULL << 63;
+    static const uint64_t NONE = UINT64_MAX;
+
+    ClaimTable(pmr::memory_resource *mem = pmr::get_default_resource()) {
+        for (Shard &shard : shards) {
+            shard.slots = pmr::vector<pair<TermId, uint64_t>>(64, { NO_TERM, NONE }, mem);
+        }
+    }
+
+    static uint64_t rank(size_t position, size_t successor) {
+        return ((uint64_t)position << 24) | successor;
+    }
+
+    // Records a claim on key; returns false if key is already settled.
+    bool claim(const TermStore &ts, TermId key, uint64_t rank) {
+        Shard &shard = shard_of(ts, key);
+        lock_guard<mutex> guard(shard.lock);
+        pair<TermId, uint64_t> &slot = find_slot(ts, shard, key);
+        if (slot.first == NO_TERM) {
+            slot = { key, rank };
+            if (2 * ++shard.count > shard.slots.size()) grow(ts, shard);
+            return true;
+        }
+        if (slot.second & SETTLED) return false;
+        slot.second = min(slot.second, rank);
+        return true;
+    }
+    uint64_t get(const TermStore &ts, TermId key) {
+        Shard &shard = shard_of(ts, key);
+        lock_guard<mutex> guard(shard.lock);
+        return find_slot(ts, shard, key).second;
+    }
+    void settle(const TermStore &ts, TermId key, uint32_t state) {
+        Shard &shard = shard_of(ts, key);
+        lock_guard<mutex> guard(shard.lock);
+        pair<TermId, uint64_t> &slot = find_slot(ts, shard, key);
+        if (slot.first == NO_TERM) {
+            slot.first = key;
+            if (2 * ++shard.count > shard.slots.size()) {
+                slot.second = SETTLED | state;
+                grow(ts, shard);
+                return;
+            }
+        }
+        slot.second = SETTLED | state;
+    }
+
+private:
+    static const int SHARD_BITS = 6;
+
+    struct Shard {
+        mutex lock;
+        pmr::vector<pair<TermId, uint64_t>> slots;
+        size_t count = 0;
+    };
+
+    Shard shards[1 << SHARD_BITS];
+
+    Shard &shard_of(const TermStore &ts, TermId key) {
+        return shards[ts.hash(key) >> (64 - SHARD_BITS)];
+    }
+    pair<TermId, uint64_t> &find_slot(const TermStore &ts, Shard &shard, TermId key) {
+        size_t mask = shard.slots.size() - 1;
+        size_t i = ts.hash(key) & mask;
+        while (shard.slots[i].first != NO_TERM && shard.slots[i].first != key) {
+            i = (i + 1) & mask;
+        }
+        return shard.slots[i];
+    }
+    void grow(const TermStore &ts, Shard &shard) {
+        pmr::vector<pair<TermId, uint64_t>> old(shard.slots.size() * 2, { NO_TERM, NONE },
+                                                shard.slots.get_allocator());
+        shard.slots.swap(old);
+        for (auto &pr : old) {
+            if (pr.first != NO_TERM) find_slot(ts, shard, pr.first) = pr;
+        }
+    }
+};
+
+
+/*
+    Level-synchronous BFS: every state of a level is expanded on the pool
+    at once, successors are claimed in the sharded ClaimTable, and the next
+    level is then collected in frontier order. It visits the same states in
+    the same order as find_shortest_path(), so it finds the same path.
+*/
+vector<pair<string, TermId>>
+find_shortest_path_parallel(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    ThreadPool &pool,
+    int max_depth=4,
+    int max_tree_size=40,
+    pmr::memory_resource *arena=pmr::get_default_resource(),
+    vector<int> *levels=nullptr,
+    SearchBudget *budget=nullptr
+) {
+    max_depth = min(max_depth, SearchState::MAX_DEPTH);
+    WidthBound bound = { (uint32_t)max_tree_size, ts[target].width };
+    // the workers allocate too, so they share the arena through a lock
+    LockedResource shared_arena(arena);
+    pmr::vector<SearchState> nodes(arena);
+    ClaimTable vis(&shared_arena);
+    pmr::vector<uint32_t> frontier(1, 0, arena);
+
+    nodes.push_back({ start, TermIndex::NONE, 0, SearchState::NO_RULE });
+    vis.settle(ts, start, 0);
+    states = 0;
+
+    for (int depth = 0; !frontier.empty(); depth++) {
+        for (size_t i = 0; i < frontier.size(); i++) {
+            if (nodes[frontier[i]].term == target) {
+                states += (int)i + 1;
+                count_levels(nodes, levels);
+                ok = true;
+                return trace_path(nodes, frontier[i], rules);
+            }
+        }
+        states += (int)frontier.size();
+        if (depth >= max_depth) {
+            break;
+        }
+
+        // per frontier state: (rule, term) of each successor
+        pmr::vector<pmr::vector<pair<uint32_t, TermId>>> generated(frontier.size(), &shared_arena);
+        pool.parallel_for(frontier.size(), [&](size_t i) {
+            TermId u = nodes[frontier[i]].term;
+            if ((int)ts[u].width > max_tree_size) {
+                return;
+            }
+            if (budget && budget->spent(depth, nodes.size() - frontier.size() + i, frontier.size() - i)) {
+                return;
+            }
+            vector<Successor> successors;
+            possible_next_trees(ts, rules, u, successors, bound);
+            generated[i].reserve(successors.size());
+            for (size_t j = 0; j < successors.size(); j++) {
+                TermId v = apply_at(ts, u, successors[j].position, successors[j].replacement);
+                generated[i].push_back({ successors[j].rule, v });
+                vis.claim(ts, v, ClaimTable::rank(i, j));
+            }
+        });
+        if (budget && budget->exhausted() != SearchBudget::NONE) {
+            ok = false;
+            return {};
+        }
+
+        pmr::vector<uint32_t> next(arena);
+        for (size_t i = 0; i < frontier.size(); i++) {
+            for (size_t j = 0; j < generated[i].size(); j++) {
+                TermId v = generated[i][j].second;
+                if (vis.get(ts, v) != ClaimTable::rank(i, j)) {
+                    continue;
+                }
+                uint32_t vi = (uint32_t)nodes.size();
+                vis.settle(ts, v, vi);
+                nodes.push_back({ v, frontier[i], depth + 1, generated[i][j].first });
+                next.push_back(vi);
+            }
+        }
+        frontier.swap(next);
+    }
+
+    count_levels(nodes, levels);
+    ok = false;
+    return {};
+}
+
+
+/*
+    Transposition table of the work-stealing search: one word per term id
+    of the store, packing the depth the term was reached at, its parent
+    term and the rule, changed by compare-and-swap only. The search runs
+    on an overlay store, whose own LOCAL ids are dense: the table is
+    indexed by them directly and grows a segment at a time as the overlay
+    does, the only lock being the one allocating a segment. Ids of the
+    base store can be anywhere up to its size, so the few a search meets
+    (start, target and the terms earlier goals built) go in a side table
+    hashed into shards instead.
+*/
+class TranspositionTable {
+public:
+    static const int MAX_DEPTH = 254;  // depth + 1 takes the top byte, 0 is empty
+
+    TranspositionTable() {
+        for (size_t i = 0; i < MAX_SEGMENTS; i++) segments[i] = nullptr;
+    }
+    ~TranspositionTable() {
+        for (size_t i = 0; i < MAX_SEGMENTS; i++) delete[] segments[i].load();
+    }
+    TranspositionTable(const TranspositionTable &) = delete;
+    TranspositionTable &operator=(const TranspositionTable &) = delete;
+
+    /*
+        Records that term is reached at depth, from parent by rule, unless
+        it already is at that depth or shallower; fresh tells whether it
+        was reached before at all.
+    */
+    bool improve(TermId term, int depth, TermId parent, uint32_t rule, bool &fresh) {
+        atomic<uint64_t> &slot = at(term);
+        uint64_t entry = ((uint64_t)(depth + 1) << 56) | ((uint64_t)rule << 32) | parent;
+        uint64_t old = slot.load(memory_order_relaxed);
+        while (old == 0 || depth_of(old) > depth) {
+            if (slot.compare_exchange_weak(old, entry)) {
+                fresh = old == 0;
+                return true;
+            }
+        }
+        return false;
+    }
+    uint64_t get(TermId term) {
+        return at(term).load();
+    }
+
+    static int depth_of(uint64_t entry) {
+        return (int)(entry >> 56) - 1;
+    }
+    static TermId parent_of(uint64_t entry) {
+        return (TermId)entry;
+    }
+    static uint32_t rule_of(uint64_t entry) {
+        return (uint32_t)(entry >> 32) & 0xffffff;
+    }
+
+private:
+    // laid out as SegmentedVector, over the ids of the overlay
+    static const size_t FIRST_BITS = 10;
+    static const size_t MAX_SEGMENTS = 32;
+    static const int SHARD_BITS = 6;
+
+    // entries of base store ids; map nodes stay put, so slots outlive the lock
+    struct Shard {
+        mutex lock;
+        unordered_map<TermId, atomic<uint64_t>> slots;
+    };
+
+    atomic<atomic<uint64_t> *> segments[MAX_SEGMENTS];
+    mutex alloc_lock;
+    Shard shards[1 << SHARD_BITS];
+
+    atomic<uint64_t> &at(TermId id) {
+        if (!(id & TermStore::LOCAL)) {
+            Shard &shard = shards[hash_combine(0, id) >> (64 - SHARD_BITS)];
+            lock_guard<mutex> guard(shard.lock);
+            return shard.slots[id];
+        }
+        size_t i = id & ~TermStore::LOCAL;
+        size_t s = 63 - __builtin_clzll((i >> FIRST_BITS) + 1);
+        size_t first = (((size_t)1 << s) - 1) << FIRST_BITS;
+        atomic<uint64_t> *seg = segments[s].load(memory_order_acquire);
+        if (!seg) {
+            lock_guard<mutex> guard(alloc_lock);
+            seg = segments[s].load(memory_order_acquire);
+            if (!seg) {
+                seg = new atomic<uint64_t>[(size_t)1 << (FIRST_BITS + s)]();
+                segments[s].store(seg, memory_order_release);
+            }
+        }
+        return seg[i - first];
+    }
+};
+
+
+/*
+    The states a worker of the work-stealing search has queued, by depth.
+    The owner takes the newest state of the shallowest depth, and a thief
+    the older half of it, so that both work best-first.
+*/
+class StealQueue {
+public:
+    void push(TermId term, int depth) {
+        lock_guard<mutex> guard(lock);
+        if ((int)buckets.size() <= depth) buckets.resize(depth + 1);
+        buckets[depth].push_back(term);
+        lowest = min(lowest, depth);
+    }
+    bool pop(TermId &term, int &depth) {
+        lock_guard<mutex> guard(lock);
+        for (; lowest < (int)buckets.size(); lowest++) {
+            if (buckets[lowest].empty()) continue;
+            term = buckets[lowest].back();
+            depth = lowest;
+            buckets[lowest].pop_back();
+            return true;
+        }
+        return false;
+    }
+    // Moves the older half of the shallowest states to out.
+    bool steal(vector<TermId> &out, int &depth) {
+        lock_guard<mutex> guard(lock);
+        for (; lowest < (int)buckets.size(); lowest++) {
+            vector<TermId> &bucket = buckets[lowest];
+            if (bucket.empty()) continue;
+            size_t n = (bucket.size() + 1) / 2;
+            out.assign(bucket.begin(), bucket.begin() + n);
+            bucket.erase(bucket.begin(), bucket.begin() + n);
+            depth = lowest;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    mutex lock;
+    vector<vector<TermId>> buckets;
+    int lowest = 0;
+};
+
+
+/*
+    Work-stealing best-first search, for `param search_mode best_first.`.
+    There is no barrier between depths: each of the threads expands the
+    shallowest state of its own queue and, when that is empty, steals from
+    another's. A state reached shallower than before is queued again, so
+    the depths in the table settle to those of the BFS. Reaching the target
+    lowers a shared bound, after which only states that could still reach
+    it sooner are expanded, and the search ends when no work is left. The
+    path is a shortest one within max_search_depth, but as states are
+    expanded in no fixed order it and the state count can differ from run
+    to run.
+*/
+vector<pair<string, TermId>>
+find_shortest_path_stealing(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    ThreadPool &pool,
+    int max_depth=4,
+    int max_tree_size=40,
+    SearchBudget *budget=nullptr
+) {
+    max_depth = min(max_depth, TranspositionTable::MAX_DEPTH);
+    WidthBound bound = { (uint32_t)max_tree_size, ts[target].width };
+    size_t workers = pool.size() + 1;
+    vector<StealQueue> queues(workers);
+    TranspositionTable table;
+    atomic<int64_t> pending(1);  // queued or being expanded
+    atomic<int> best(INT_MAX);   // depth target was reached at
+    atomic<int> reached(1);
+
+    bool fresh;
+    table.improve(start, 0, NO_TERM, SearchState::NO_RULE, fresh);
+    if (start == target) {
+        ok = true;
+        states = 1;
+        return {};
+    }
+    queues[0].push(start, 0);
+
+    pool.parallel_for(workers, [&](size_t w) {
+        vector<Successor> successors;
+        vector<TermId> stolen;
+        while (pending.load() > 0) {
+            if (budget && budget->exhausted() != SearchBudget::NONE) break;
+            TermId u;
+            int depth;
+            if (!queues[w].pop(u, depth)) {
+                bool found = false;
+                for (size_t k = 1; k < workers && !found; k++) {
+                    found = queues[(w + k) % workers].steal(stolen, depth);
+                }
+                if (!found) {
+                    this_thread::yield();
+                    continue;
+                }
+                u = stolen.back();
+                stolen.pop_back();
+                for (TermId t : stolen) queues[w].push(t, depth);
+            }
+            // skipped if reached shallower since it was queued
+            if (TranspositionTable::depth_of(table.get(u)) == depth && depth < max_depth &&
+                depth + 1 < best.load() && (int)ts[u].width <= max_tree_size &&
+                !(budget && budget->spent(depth, reached.load(), pending.load()))) {
+                possible_next_trees(ts, rules, u, successors, bound);
+                for (const Successor &succ : successors) {
+                    TermId v = apply_at(ts, u, succ.position, succ.replacement);
+                    if (!table.improve(v, depth + 1, u, succ.rule, fresh)) continue;
+                    if (fresh) reached++;
+                    if (v == target) {
+                        int b = best.load();
+                        while (depth + 1 < b && !best.compare_exchange_weak(b, depth + 1)) {}
+                        continue;
+                    }
+                    pending++;
+                    queues[w].push(v, depth + 1);
+                }
+            }
+            pending--;
+        }
+    }, 1);
+
+    // if the budget ran out, the path found so far need not be a shortest one, but it is a proof
+    states = reached.load();
+    ok = best.load() != INT_MAX;
+    if (!ok) return {};
+    vector<pair<string, TermId>> path;
+    for (TermId v = target; v != start;) {
+        uint64_t entry = table.get(v);
+        path.push_back({ rules.rules[TranspositionTable::rule_of(entry)].name, v });
+        v = TranspositionTable::parent_of(entry);
+    }
+    reverse(path.begin(), path.end());
+    return path;
+}
+
+
+/*
+    External-memory BFS, for searches whose visited states do not fit in
+    RAM (`param spill_dir`). Every level of the search is a file in the
+    spill directory, holding one record per state, sorted by term:
+
+        varint term length, term, varint parent, varint rule
+
+    The term is in preorder, one varint per node packing its symbol, type
+    and arity, and parent is the index of the parent's record in the file
+    of the level before. A level is expanded by streaming its file through
+    an overlay store that is replaced whenever it outgrows half the memory
+    budget; the successors are collected into sorted runs of the other
+    half. Merging the runs drops duplicates within the next level, and
+    merging against the files of all earlier levels drops the states seen
+    before, which is what the visited set does in memory. The path is read
+    back from the files at the end.
+
+    Shortest paths have the same length as with find_shortest_path(), but
+    as a level is expanded in term order rather than in the order it was
+    reached the path and the state count can differ.
+*/
+void
+put_varint(string &out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+
+uint64_t
+get_varint(const char *&p)
+{
+    uint64_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t b = (uint8_t)*p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80) return v;
+    }
+}
+
+
+void
+spill_term(const TermStore &ts, TermId id, string &out)
+{
+    const Term &t = ts[id];
+    put_varint(out, ((uint64_t)t.sym << 4) | ((uint64_t)t.type << 2) | t.arity);
+    for (int i = 0; i < (int)t.arity; i++) {
+        spill_term(ts, t.children[i], out);
+    }
+}
+
+
+TermId
+unspill_term(TermStore &ts, const char *&p)
+{
+    uint64_t code = get_varint(p);
+    int arity = (int)(code & 3);
+    TermId children[2] = { 0, 0 };
+    for (int i = 0; i < arity; i++) {
+        children[i] = unspill_term(ts, p);
+    }
+    return ts.make((NodeType)((code >> 2) & 3), (Symbol)(code >> 4), arity, children[0], children[1]);
+}
+
+
+// Names the files of one search and removes them when it is done.
+class SpillFiles {
+public:
+    SpillFiles(const string &dir) {
+        static atomic<uint64_t> searches(0);
+        prefix = dir + "/prover-" + to_string(getpid()) + "-" + to_string(searches++) + "-";
+    }
+    ~SpillFiles() {
+        for (const string &path : paths) unlink(path.c_str());
+    }
+    const string &level(int depth) {
+        return name("level" + to_string(depth));
+    }
+    const string &run(int depth, size_t i) {
+        return name("level" + to_string(depth) + "-run" + to_string(i));
+    }
+    void remove(const string &path) {
+        unlink(path.c_str());
+    }
+
+private:
+    string prefix;
+    set<string> paths;
+
+    const string &name(const string &suffix) {
+        return *paths.insert(prefix + suffix).first;
+    }
+};
+
+
+class SpillWriter {
+public:
+    uint32_t count;  // records written
+
+    SpillWriter(const string &_path) : count(0), path(_path), out(fopen(path.c_str(), "wb")) {
+        if (!out) {
+            throw_failure(ProverError::IO, "SpillWriter() :: cannot write " + path + ".");
+        }
+    }
+    ~SpillWriter() {
+        close();
+    }
+    void write(string_view term, uint32_t parent, uint32_t rule) {
+        record.clear();
+        put_varint(record, term.size());
+        record += term;
+        put_varint(record, parent);
+        put_varint(record, rule);
+        if (fwrite(record.data(), 1, record.size(), out) != record.size()) fail();
+        count++;
+    }
+    void close() {
+        if (out && fclose(out) != 0) {
+            out = nullptr;
+            fail();
+        }
+        out = nullptr;
+    }
+
+private:
+    string path;
+    FILE *out;
+    string record;
+
+    void fail() {
+        throw_failure(ProverError::IO, "SpillWriter::write() :: could not write " + path + ".");
+    }
+};
+
+
+// Reads the records of a SpillWriter file in order; valid is false past the last.
+class SpillReader {
+public:
+    bool valid;
+    string term;
+    uint32_t parent, rule;
+    uint32_t index;  // of the current record
+
+    SpillReader(const string &path) : valid(false), parent(0), rule(0), index(UINT32_MAX),
+                                      in(fopen(path.c_str(), "rb")) {
+        if (!in) {
+            throw_failure(ProverError::IO, "SpillReader() :: cannot read " + path + ".");
+        }
+        next();
+    }
+    ~SpillReader() {
+        fclose(in);
+    }
+    SpillReader(const SpillReader &) = delete;
+    SpillReader &operator=(const SpillReader &) = delete;
+
+    void next() {
+        uint64_t length;
+        valid = read_varint(length);
+        if (!valid) return;
+        term.resize(length);
+        if (fread(term.data(), 1, length, in) != length) truncated();
+        uint64_t p, r;
+        if (!read_varint(p) || !read_varint(r)) truncated();
+        parent = (uint32_t)p;
+        rule = (uint32_t)r;
+        index++;
+    }
+
+private:
+    FILE *in;
+
+    bool read_varint(uint64_t &v) {
+        v = 0;
+        for (int shift = 0; ; shift += 7) {
+            int c = getc_unlocked(in);
+            if (c == EOF) {
+                if (shift > 0) truncated();
+                return false;
+            }
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if (c < 0x80) return true;
+        }
+    }
+    void truncated() {
+        throw_failure(ProverError::IO, "SpillReader::next() :: truncated spill file.");
+    }
+};
+
+
+// The successors of one level in memory, until they are sorted into a run.
+class SpillBuffer {
+public:
+    void add(const TermStore &ts, TermId term, uint32_t parent, uint32_t rule) {
+        uint32_t offset = (uint32_t)bytes.size();
+        spill_term(ts, term, bytes);
+        entries.push_back({ offset, (uint32_t)bytes.size() - offset, parent, rule });
+    }
+    size_t memory() const {
+        return bytes.size() + entries.size() * sizeof(Entry);
+    }
+    bool empty() const {
+        return entries.empty();
+    }
+    // Writes the entries sorted by term, the first of each term only.
+    void flush(const string &path) {
+        sort(entries.begin(), entries.end(), [&](const Entry &x, const Entry &y) {
+            int c = view(x).compare(view(y));
+            return c != 0 ? c < 0 : x.parent < y.parent;
+        });
+        SpillWriter out(path);
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (i > 0 && view(entries[i]) == view(entries[i - 1])) continue;
+            out.write(view(entries[i]), entries[i].parent, entries[i].rule);
+        }
+        bytes.clear();
+        entries.clear();
+    }
+
+private:
+    struct Entry {
+        uint32_t offset, length, parent, rule;
+    };
+    string bytes;
+    vector<Entry> entries;
+
+    string_view view(const Entry &e) const {
+        return string_view(bytes).substr(e.offset, e.length);
+    }
+};
+
+
+/*
+    Merges the sorted runs into the file of the next level, keeping the
+    first record of each term and only the terms that are in none of the
+    earlier levels. Returns the number of states written.
+*/
+uint32_t
+merge_spill_runs(const vector<string> &runs, const vector<string> &earlier, const string &path)
+{
+    vector<unique_ptr<SpillReader>> inputs, seen;
+    for (const string &run : runs) inputs.push_back(make_unique<SpillReader>(run));
+    for (const string &level : earlier) seen.push_back(make_unique<SpillReader>(level));
+
+    auto later = [&](size_t x, size_t y) {
+        int c = inputs[x]->term.compare(inputs[y]->term);
+        return c != 0 ? c > 0 : inputs[x]->parent > inputs[y]->parent;
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heap(later);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i]->valid) heap.push(i);
+    }
+
+    SpillWriter out(path);
+    string last;
+    bool any = false;
+    while (!heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+        SpillReader &in = *inputs[i];
+        if (!any || in.term != last) {
+            any = true;
+            last = in.term;
+            bool old = false;
+            for (auto &level : seen) {
+                while (level->valid && level->term < last) level->next();
+                old = old || (level->valid && level->term == last);
+            }
+            if (!old) out.write(last, in.parent, in.rule);
+        }
+        in.next();
+        if (in.valid) heap.push(i);
+    }
+    return out.count;
+}
+
+
+vector<pair<string, TermId>>
+find_shortest_path_external(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    const string &dir,
+    size_t memory,
+    int max_depth=4,
+    int max_tree_size=40,
+    SearchBudget *budget=nullptr
+) {
+    SpillFiles files(dir);
+    WidthBound bound = { (uint32_t)max_tree_size, ts[target].width };
+    vector<string> levels;
+    {
+        string term;
+        spill_term(ts, start, term);
+        levels.push_back(files.level(0));
+        SpillWriter(levels[0]).write(term, TermIndex::NONE, 0);
+    }
+    states = 0;
+    ok = false;
+    if (start == target) {
+        states = 1;
+        ok = true;
+        return {};
+    }
+
+    // where the target was reached from: a record of the last level, by a rule
+    uint32_t found_parent = 0, found_rule = 0;
+    uint32_t count = 1;
+    vector<Successor> successors;
+    int depth = 0;
+    for (; depth < max_depth && count > 0 && !ok; depth++) {
+        vector<string> runs;
+        SpillBuffer buffer;
+        unique_ptr<TermStore> local = make_unique<TermStore>(&ts);
+        for (SpillReader level(levels[depth]); level.valid && !ok; level.next()) {
+            states++;
+            if (local->size() * sizeof(Term) > memory / 2) {
+                local = make_unique<TermStore>(&ts);
+            }
+            const char *p = level.term.data();
+            TermId u = unspill_term(*local, p);
+            if ((int)(*local)[u].width > max_tree_size) {
+                continue;
+            }
+            if (budget && budget->spent(depth, states, count - level.index)) {
+                return {};
+            }
+            possible_next_trees(*local, rules, u, successors, bound);
+            for (const Successor &succ : successors) {
+                TermId v = apply_at(*local, u, succ.position, succ.replacement);
+                if (v == target) {
+                    ok = true;
+                    found_parent = level.index;
+                    found_rule = succ.rule;
+                    break;
+                }
+                buffer.add(*local, v, level.index, succ.rule);
+                if (buffer.memory() > memory / 2) {
+                    runs.push_back(files.run(depth + 1, runs.size()));
+                    buffer.flush(runs.back());
+                }
+            }
+        }
+        if (ok) break;
+        runs.push_back(files.run(depth + 1, runs.size()));
+        buffer.flush(runs.back());
+        levels.push_back(files.level(depth + 1));
+        count = merge_spill_runs(runs, vector<string>(levels.begin(), levels.end() - 1), levels.back());
+        for (const string &run : runs) files.remove(run);
+    }
+    if (!ok) {
+        // like the other engines, the states of the last level count as checked
+        if (depth == max_depth) states += count;
+        return {};
+    }
+
+    // walk the parent links back, reading each level up to the record needed
+    vector<pair<string, TermId>> path = {{ rules.rules[found_rule].name, target }};
+    uint32_t parent = found_parent;
+    for (int d = depth; d > 0; d--) {
+        SpillReader level(levels[d]);
+        while (level.index != parent) level.next();
+        const char *p = level.term.data();
+        path.push_back({ rules.rules[level.rule].name, unspill_term(ts, p) });
+        parent = level.parent;
+    }
+    reverse(path.begin(), path.end());
+    return path;
+}
+
+
+/*
+    Semantic pre-check. Reading + as or, * as and, ~ as not and 0, 1 as the
+    constants, every axiom of a Boolean algebra holds under every
+    assignment, and so does everything rewriting proves from them. A goal
+    whose sides differ under some assignment therefore has no proof and is
+    refuted without searching. Up to TruthTable::MAX_VARS variables both
+    sides are evaluated on all assignments at once, 64 per machine word;
+    above that they are compared as reduced ordered BDDs.
+*/
+bool
+is_boolean_term(const TermStore &ts, TermId id)
+{
+    const Term &t = ts[id];
+    const string &name = ts.symbols.name(t.sym);
+    if (t.type == PRIM) {
+        return name == "0" || name == "1";
+    } else if (t.type == VAR || t.type == UNRES) {
+        return true;
+    } else if (t.type == OP) {
+        if (!((name == "~" && t.arity == 1) || ((name == "+" || name == "*") && t.arity == 2))) {
+            return false;
+        }
+        for (int i = 0; i < t.arity; i++) {
+            if (!is_boolean_term(ts, t.children[i])) return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+
+class TruthTable {
+public:
+    static const size_t MAX_VARS = 16;
+
+    TruthTable(const TermStore &_ts, const vector<Symbol> &_vars)
+        : ts(_ts), vars(_vars), words(vars.size() <= 6 ? 1 : (size_t)1 << (vars.size() - 6)) {
+        // assignments past 2^n in the only word of a small table are not real
+        valid = vars.size() >= 6 ? ~0ull : (1ull << (1u << vars.size())) - 1;
+    }
+
+    const vector<uint64_t> &eval(TermId id) {
+        auto it = memo.find(id);
+        if (it != memo.end()) return it->second;
+        const Term &t = ts[id];
+        const string &name = ts.symbols.name(t.sym);
+        vector<uint64_t> value(words);
+        if (t.type == PRIM) {
+            fill(value.begin(), value.end(), name == "1" ? ~0ull : 0ull);
+        } else if (t.type == VAR || t.type == UNRES) {
+            // bit b of word w is assignment 64 * w + b, whose bit i is variable i
+            static const uint64_t PATTERNS[6] = {
+                0xAAAAAAAAAAAAAAAAull, 0xCCCCCCCCCCCCCCCCull, 0xF0F0F0F0F0F0F0F0ull,
+                0xFF00FF00FF00FF00ull, 0xFFFF0000FFFF0000ull, 0xFFFFFFFF00000000ull,
+            };
+            size_t i = find(vars.begin(), vars.end(), t.sym) - vars.begin();
+            for (size_t w = 0; w < words; w++) {
+                value[w] = i < 6 ? PATTERNS[i] : ((w >> (i - 6)) & 1) ? ~0ull : 0ull;
+            }
+        } else if (t.arity == 1) {
+            const vector<uint64_t> &a = eval(t.children[0]);
+            for (size_t w = 0; w < words; w++) value[w] = ~a[w];
+        } else {
+            const vector<uint64_t> &a = eval(t.children[0]);
+            const vector<uint64_t> &b = eval(t.children[1]);
+            for (size_t w = 0; w < words; w++) value[w] = name == "+" ? a[w] | b[w] : a[w] & b[w];
+        }
+        return memo[id] = move(value);
+    }
+
+    // Whether a and b agree everywhere; if not, the first assignment where they differ.
+    bool equivalent(TermId a, TermId b, vector<bool> &counterexample) {
+        const vector<uint64_t> &x = eval(a);
+        const vector<uint64_t> &y = eval(b);
+        for (size_t w = 0; w < words; w++) {
+            uint64_t diff = (x[w] ^ y[w]) & valid;
+            if (diff) {
+                uint64_t assignment = 64 * w + __builtin_ctzll(diff);
+                counterexample.clear();
+                for (size_t i = 0; i < vars.size(); i++) counterexample.push_back((assignment >> i) & 1);
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    const TermStore &ts;
+    const vector<Symbol> &vars;
+    size_t words;
+    uint64_t valid;
+    unordered_map<TermId, vector<uint64_t>> memo;
+};
+
+
+class Bdd {
+public:
+    static const uint32_t FALSE = 0, TRUE = 1;
+    static const size_t MAX_NODES = 1 << 22;
+
+    Bdd(const TermStore &_ts, const vector<Symbol> &_vars) : ts(_ts), vars(_vars) {
+        uint32_t terminal = (uint32_t)vars.size();
+        nodes.push_back({ terminal, FALSE, FALSE });
+        nodes.push_back({ terminal, TRUE, TRUE });
+    }
+
+    // Sets ok to false when the diagram grows past MAX_NODES.
+    uint32_t build(bool &ok, TermId id) {
+        const Term &t = ts[id];
+        const string &name = ts.symbols.name(t.sym);
+        if (t.type == PRIM) {
+            return name == "1" ? TRUE : FALSE;
+        } else if (t.type == VAR || t.type == UNRES) {
+            uint32_t i = (uint32_t)(find(vars.begin(), vars.end(), t.sym) - vars.begin());
+            return make(ok, i, FALSE, TRUE);
+        } else if (t.arity == 1) {
+            return apply(ok, '^', build(ok, t.children[0]), TRUE);
+        }
+        uint32_t a = build(ok, t.children[0]);
+        uint32_t b = build(ok, t.children[1]);
+        return apply(ok, name == "+" ? '|' : '&', a, b);
+    }
+
+    uint32_t apply(bool &ok, char op, uint32_t a, uint32_t b) {
+        if (!ok) return FALSE;
+        if (a <= TRUE && b <= TRUE) {
+            return op == '|' ? (a | b) : op == '&' ? (a & b) : (a ^ b);
+        }
+        auto key = make_tuple(op, a, b);
+        auto it = computed.find(key);
+        if (it != computed.end()) return it->second;
+        uint32_t var = min(nodes[a].var, nodes[b].var);
+        uint32_t lo = apply(ok, op, cofactor(a, var, false), cofactor(b, var, false));
+        uint32_t hi = apply(ok, op, cofactor(a, var, true), cofactor(b, var, true));
+        return computed[key] = make(ok, var, lo, hi);
+    }
+
+    // An assignment under which f is true, for f != FALSE.
+    vector<bool> witness(uint32_t f) const {
+        vector<bool> values(vars.size(), false);
+        while (f > TRUE) {
+            bool high = nodes[f].lo == FALSE;
+            values[nodes[f].var] = high;
+            f = high ? nodes[f].hi : nodes[f].lo;
+        }
+        return values;
+    }
+
+private:
+    struct BddNode {
+        uint32_t var, lo, hi;
+    };
+
+    const TermStore &ts;
+    const vector<Symbol> &vars;
+    vector<BddNode> nodes;
+    map<tuple<uint32_t, uint32_t, uint32_t>, uint32_t> unique;
+    map<tuple<char, uint32_t, uint32_t>, uint32_t> computed;
+
+    uint32_t cofactor(uint32_t f, uint32_t var, bool value) const {
+        if (nodes[f].var != var) return f;
+        return value ? nodes[f].hi : nodes[f].lo;
+    }
+    uint32_t make(bool &ok, uint32_t var, uint32_t lo, uint32_t hi) {
+        if (lo == hi) return lo;
+        auto key = make_tuple(var, lo, hi);
+        auto it = unique.find(key);
+        if (it != unique.end()) return it->second;
+        if (nodes.size() >= MAX_NODES) {
+            ok = false;
+            return FALSE;
+        }
+        nodes.push_back({ var, lo, hi });
+        return unique[key] = (uint32_t)nodes.size() - 1;
+    }
+};
+
+
+/*
+    Compares a and b over the given variables. Sets ok to false when they
+    are not Boolean terms or are too large to decide.
+*/
+bool
+boolean_equivalent(
+    bool &ok,
+    const TermStore &ts,
+    TermId a,
+    TermId b,
+    const vector<Symbol> &vars,
+    vector<bool> &counterexample
+) {
+    ok = is_boolean_term(ts, a) && is_boolean_term(ts, b);
+    if (!ok) return false;
+    if (vars.size() <= TruthTable::MAX_VARS) {
+        return TruthTable(ts, vars).equivalent(a, b, counterexample);
+    }
+    Bdd bdd(ts, vars);
+    uint32_t diff = bdd.apply(ok, '^', bdd.build(ok, a), bdd.build(ok, b));
+    if (!ok || diff == Bdd::FALSE) return true;
+    counterexample = bdd.witness(diff);
+    return false;
+}
+
+
+/*
+    Returns true when the goal is refuted, with the values of the goal's
+    variables that tell its sides apart.
+*/
+bool
+refute_goal(
+    const TermStore &ts,
+    const vector<Axiom> &axioms,
+    TermId start,
+    TermId target,
+    vector<pair<Symbol, bool>> &counterexample
+) {
+    bool ok;
+    vector<bool> values;
+    vector<Symbol> vars;
+    get_variables(ts, start, vars);
+    get_variables(ts, target, vars);
+    if (boolean_equivalent(ok, ts, start, target, vars, values) || !ok) {
+        return false;
+    }
+    // only sound when the axioms themselves hold under this reading
+    for (const Axiom &ax : axioms) {
+        vector<Symbol> ax_vars;
+        vector<bool> ignored;
+        get_variables(ts, ax.rule_a, ax_vars);
+        get_variables(ts, ax.rule_b, ax_vars);
+        if (!boolean_equivalent(ok, ts, ax.rule_a, ax.rule_b, ax_vars, ignored) || !ok) {
+            return false;
+        }
+    }
+    counterexample.clear();
+    for (size_t i = 0; i < vars.size(); i++) counterexample.push_back({ vars[i], values[i] });
+    return true;
+}
+
+
+/*
+    Knuth-Bendix completion, for `param completion true.`. The axioms are
+    turned once into rewrite rules that decrease in a Knuth-Bendix order
+    and closed under critical pairs; a goal is then proved by rewriting
+    both sides to normal form, and if they meet no search is needed.
+    Equations the order cannot orient, like commutativity, are kept and
+    used in whichever direction makes an instance smaller (ordered
+    rewriting), with the variables of the goal read as constants.
+
+    Every equation carries its proof by the axioms, so a proof by normal
+    forms prints as the usual rewrite steps. The Boolean axioms have no
+    finite completion of this kind, so the loop stops at fixed limits and
+    the system is as strong as it got by then; goals whose sides do not
+    meet go to the search as before.
+*/
+
+bool
+is_variable(const Term &t)
+{
+    return t.type == VAR || t.type == UNRES;
+}
+
+
+void
+count_variables(const TermStore &ts, TermId id, int sign, vector<pair<Symbol, int>> &counts)
+{
+    const Term &t = ts[id];
+    if (is_variable(t)) {
+        for (auto &pr : counts) {
+            if (pr.first == t.sym) {
+                pr.second += sign;
+                return;
+            }
+        }
+        counts.push_back({ t.sym, sign });
+        return;
+    }
+    for (int i = 0; i < (int)t.arity; i++) count_variables(ts, t.children[i], sign, counts);
+}
+
+
+// Heads ranked by arity, then variables below primitives below operators, then name.
+int
+compare_heads(const TermStore &ts, const Term &a, const Term &b)
+{
+    auto rank = [](const Term &t) { return is_variable(t) ? 0 : t.type == PRIM ? 1 : 2; };
+    if (a.arity != b.arity) return a.arity < b.arity ? -1 : 1;
+    if (rank(a) != rank(b)) return rank(a) < rank(b) ? -1 : 1;
+    if (a.sym == b.sym) return 0;
+    return ts.symbols.name(a.sym) < ts.symbols.name(b.sym) ? -1 : 1;
+}
+
+
+/*
+    The Knuth-Bendix order with every symbol and variable of weight 1, so
+    that the weight of a term is its size, and heads as compare_heads()
+    ranks them. With ground set, variables are taken as constants, which
+    makes the order total, as ordered rewriting of a goal needs.
+*/
+bool
+kbo_greater(const TermStore &ts, TermId s, TermId t, bool ground)
+{
+    if (s == t) return false;
+    const Term &a = ts[s];
+    const Term &b = ts[t];
+    if (!ground) {
+        if (is_variable(a)) return false;
+        vector<pair<Symbol, int>> counts;
+        count_variables(ts, s, 1, counts);
+        count_variables(ts, t, -1, counts);
+        for (auto &pr : counts) {
+            if (pr.second < 0) return false;
+        }
+    }
+    if (a.size != b.size) return a.size > b.size;
+    int head = compare_heads(ts, a, b);
+    if (head != 0) return head > 0;
+    for (int i = 0; i < (int)a.arity; i++) {
+        if (a.children[i] != b.children[i]) return kbo_greater(ts, a.children[i], b.children[i], ground);
+    }
+    return false;
+}
+
+
+// t with the variables bound in scope replaced; unbound ones are left alone.
+TermId
+substitute(TermStore &ts, TermId id, const Scope &scope)
+{
+    Term t = ts[id];
+    if (is_variable(t)) {
+        const TermId *bound = scope_find(scope, t.sym);
+        return bound ? *bound : id;
+    }
+    if (t.arity == 0) return id;
+    TermId a = substitute(ts, t.children[0], scope);
+    TermId b = t.arity == 2 ? substitute(ts, t.children[1], scope) : 0;
+    if (a == t.children[0] && b == t.children[1]) return id;
+    return ts.make(OP, t.sym, t.arity, a, b);
+}
+
+
+TermId
+walk(const TermStore &ts, TermId id, const Scope &scope)
+{
+    while (is_variable(ts[id])) {
+        const TermId *bound = scope_find(scope, ts[id].sym);
+        if (!bound) break;
+        id = *bound;
+    }
+    return id;
+}
+
+
+bool
+occurs(const TermStore &ts, Symbol var, TermId id, const Scope &scope)
+{
+    id = walk(ts, id, scope);
+    const Term &t = ts[id];
+    if (is_variable(t)) return t.sym == var;
+    for (int i = 0; i < (int)t.arity; i++) {
+        if (occurs(ts, var, t.children[i], scope)) return true;
+    }
+    return false;
+}
+
+
+/*
+    Extends scope to a most general unifier of a and b, if there is one.
+    Bindings may refer to variables bound later; resolve() flattens them.
+*/
+bool
+unify(const TermStore &ts, TermId a, TermId b, Scope &scope)
+{
+    a = walk(ts, a, scope);
+    b = walk(ts, b, scope);
+    if (a == b) return true;
+    const Term &x = ts[a];
+    const Term &y = ts[b];
+    if (is_variable(x) || is_variable(y)) {
+        if (!is_variable(x)) return unify(ts, b, a, scope);
+        if (occurs(ts, x.sym, b, scope)) return false;
+        scope.push_back({ x.sym, b });
+        return true;
+    }
+    if (x.type != y.type || x.sym != y.sym || x.arity != y.arity) return false;
+    for (int i = 0; i < (int)x.arity; i++) {
+        if (!unify(ts, x.children[i], y.children[i], scope)) return false;
+    }
+    return true;
+}
+
+
+TermId
+resolve(TermStore &ts, TermId id, const Scope &scope)
+{
+    id = walk(ts, id, scope);
+    Term t = ts[id];
+    if (t.arity == 0) return id;
+    TermId a = resolve(ts, t.children[0], scope);
+    TermId b = t.arity == 2 ? resolve(ts, t.children[1], scope) : 0;
+    return ts.make(OP, t.sym, t.arity, a, b);
+}
+
+
+// The position in substitute(ts, id, scope) of the subterm at position in id.
+uint32_t
+substituted_position(TermStore &ts, TermId id, uint32_t position, const Scope &scope)
+{
+    if (position == 0) return 0;
+    Term t = ts[id];
+    uint32_t left = ts[t.children[0]].size;
+    if (position <= left) return 1 + substituted_position(ts, t.children[0], position - 1, scope);
+    uint32_t skipped = ts[substitute(ts, t.children[0], scope)].size;
+    return 1 + skipped + substituted_position(ts, t.children[1], position - 1 - left, scope);
+}
+
+
+/*
+    lhs = rhs with its proof: the steps from lhs to rhs, each the axiom it
+    applies and the term after it.
+*/
+struct Equation {
+    TermId lhs, rhs;
+    vector<pair<int, TermId>> proof;
+};
+
+Equation
+reversed(const Equation &eq)
+{
+    Equation out = { eq.rhs, eq.lhs, {} };
+    for (size_t i = eq.proof.size(); i-- > 0;) {
+        out.proof.push_back({ eq.proof[i].first, i > 0 ? eq.proof[i - 1].second : eq.lhs });
+    }
+    return out;
+}
+
+// eq followed by next, which starts where eq ends.
+void
+append(Equation &eq, const Equation &next)
+{
+    eq.proof.insert(eq.proof.end(), next.proof.begin(), next.proof.end());
+    eq.rhs = next.rhs;
+}
+
+// The instance of eq by scope, rewriting the subterm of context at position.
+Equation
+placed(TermStore &ts, const Equation &eq, const Scope &scope, TermId context, uint32_t position)
+{
+    Equation out = { apply_at(ts, context, position, substitute(ts, eq.lhs, scope)),
+                     apply_at(ts, context, position, substitute(ts, eq.rhs, scope)), {} };
+    for (auto &step : eq.proof) {
+        out.proof.push_back({ step.first, apply_at(ts, context, position, substitute(ts, step.second, scope)) });
+    }
+    return out;
+}
+
+
+// The path from start with every detour back to a term it already passed cut out.
+void
+cut_cycles(TermId start, vector<pair<string, TermId>> &path)
+{
+    vector<pair<string, TermId>> out;
+    for (auto &step : path) {
+        if (step.second == start) {
+            out.clear();
+            continue;
+        }
+        auto seen = find_if(out.begin(), out.end(), [&](auto &pr) { return pr.second == step.second; });
+        if (seen != out.end()) {
+            out.erase(seen + 1, out.end());
+            continue;
+        }
+        out.push_back(move(step));
+    }
+    path.swap(out);
+}
+
+
+class Completion {
+public:
+    static const int MAX_RULES = 200;          // rules and ordered equations kept
+    static const int MAX_PAIRS = 5000;         // equations taken from the queue
+    static const uint32_t MAX_EQUATION = 24;   // nodes in both sides of a critical pair
+    static const size_t MAX_PROOF = 256;       // steps in the proof of an equation
+    static const int MAX_REWRITES = 1000;      // steps to a normal form
+
+    vector<Equation> rules;    // lhs > rhs
+    vector<Equation> ordered;  // neither side is greater
+
+    Completion(TermStore &ts, const vector<Axiom> &axioms) : oriented(ts, {}), index(ts, {}) {
+        // smallest first, in the order found among equal sizes
+        priority_queue<pair<uint32_t, size_t>, vector<pair<uint32_t, size_t>>, greater<>> queue;
+        for (size_t i = 0; i < axioms.size(); i++) {
+            names.push_back(axioms[i].name);
+            CriticalPair axiom;
+            axiom.eq = { axioms[i].rule_a, axioms[i].rule_b, { { (int)i, axioms[i].rule_b } } };
+            queue.push({ ts[axiom.eq.lhs].size + ts[axiom.eq.rhs].size, pending.size() });
+            pending.push_back(move(axiom));
+        }
+
+        set<pair<TermId, TermId>> known;
+        for (int taken = 0; !queue.empty() && taken < MAX_PAIRS && rules.size() + ordered.size() < MAX_RULES; taken++) {
+            CriticalPair pair = move(pending[queue.top().second]);
+            queue.pop();
+            Equation left = normalize(ts, oriented, pair.eq.lhs);
+            Equation right = normalize(ts, oriented, pair.eq.rhs);
+            if (left.rhs == right.rhs) continue;
+            Equation e = reversed(left);
+            append(e, proof_of(ts, pair));
+            append(e, right);
+            if (e.proof.size() > MAX_PROOF || known.count({ e.lhs, e.rhs })) continue;
+            known.insert({ e.lhs, e.rhs });
+            known.insert({ e.rhs, e.lhs });
+
+            size_t first = directed.size();
+            if (kbo_greater(ts, e.lhs, e.rhs, false) || kbo_greater(ts, e.rhs, e.lhs, false)) {
+                if (kbo_greater(ts, e.rhs, e.lhs, false)) e = reversed(e);
+                oriented.add(ts, { .name = "", .rule_a = e.lhs, .rule_b = e.rhs, .oriented = true });
+                rules.push_back(e);
+                directed.push_back(move(e));
+            } else {
+                ordered.push_back(e);
+                directed.push_back(reversed(e));
+                directed.push_back(move(e));
+            }
+            size_t found = pending.size();
+            for (size_t i = first; i < directed.size(); i++) {
+                for (size_t j = 0; j < directed.size(); j++) {
+                    overlaps(ts, i, j, pending);
+                    if (j < first) overlaps(ts, j, i, pending);
+                }
+            }
+            for (size_t k = found; k < pending.size(); k++) {
+                queue.push({ ts[pending[k].eq.lhs].size + ts[pending[k].eq.rhs].size, k });
+            }
+        }
+        pending.clear();
+
+        for (const Equation &rule : rules) {
+            index.add(ts, { .name = "", .rule_a = rule.lhs, .rule_b = rule.rhs, .oriented = true });
+        }
+        for (const Equation &eq : ordered) {
+            index.add(ts, { .name = "", .rule_a = eq.lhs, .rule_b = eq.rhs });
+        }
+    }
+
+    /*
+        If start and target have the same normal form, the path from one to
+        the other through it, with the rewrites it took in steps.
+    */
+    bool prove(TermStore &ts, TermId start, TermId target, vector<pair<string, TermId>> &path, int &steps) const {
+        Equation left = normalize(ts, index, start);
+        Equation right = normalize(ts, index, target);
+        steps = (int)(left.proof.size() + right.proof.size());
+        if (left.rhs != right.rhs) return false;
+        append(left, reversed(right));
+        path.clear();
+        for (auto &step : left.proof) path.push_back({ names[step.first], step.second });
+        // a detour through the normal form may pass a term twice
+        cut_cycles(start, path);
+        return true;
+    }
+
+private:
+    vector<string> names;  // of the axioms, by index
+    RuleIndex oriented;    // rules, while completing
+    RuleIndex index;       // rules and ordered equations, axiom i of rules then ordered
+
+    const Equation &equation(int axiom) const {
+        return axiom < (int)rules.size() ? rules[axiom] : ordered[axiom - rules.size()];
+    }
+
+    // The path by rules of by from t to a term none of them rewrites.
+    Equation normalize(TermStore &ts, const RuleIndex &by, TermId t) const {
+        Equation path = { t, t, {} };
+        FlatTerm flat;
+        vector<int> candidates;
+        vector<Symbol> vars;
+        for (int n = 0; n < MAX_REWRITES; n++) {
+            flat.assign(ts, path.rhs);
+            bool rewrote = false;
+            for (uint32_t position = 0; position < flat.entries.size() && !rewrote; position++) {
+                by.candidates(flat, position, candidates);
+                TermId sub = flat.entries[position].id;
+                for (int r : candidates) {
+                    const Rule &rule = by.rules[r];
+                    Scope scope;
+                    if (!get_rule_replacements(ts, sub, rule.from, scope)) continue;
+                    bool is_ordered = r / 2 >= (int)rules.size();
+                    if (is_ordered) {
+                        // only rewrite goal terms, and only downwards
+                        vars.clear();
+                        get_variables(ts, rule.to, vars);
+                        bool bound = all_of(vars.begin(), vars.end(), [&](Symbol v) { return scope_find(scope, v); });
+                        if (!bound || !kbo_greater(ts, sub, substitute(ts, rule.to, scope), true)) continue;
+                    }
+                    const Equation &eq = equation(r / 2);
+                    Equation step = placed(ts, r & 1 ? reversed(eq) : eq, scope, path.rhs, position);
+                    if (path.proof.size() + step.proof.size() > MAX_REWRITES) return path;
+                    append(path, step);
+                    rewrote = true;
+                    break;
+                }
+            }
+            if (!rewrote) break;
+        }
+        return path;
+    }
+
+    /*
+        A critical pair before its proof is built, which most never need:
+        the instances of directed equations a by sa and b by sb that rewrite
+        overlap at the root and at position. Axioms come with their proof.
+    */
+    struct CriticalPair {
+        Equation eq;
+        size_t a = 0, b = 0;
+        Scope sa, sb;
+        TermId overlap = NO_TERM;
+        uint32_t position = 0;
+    };
+
+    vector<CriticalPair> pending;
+    vector<Equation> directed;  // rules and both readings of ordered equations
+
+    Equation proof_of(TermStore &ts, const CriticalPair &pair) const {
+        if (pair.overlap == NO_TERM) return pair.eq;
+        Equation eq = reversed(placed(ts, directed[pair.a], pair.sa, pair.overlap, 0));
+        append(eq, placed(ts, directed[pair.b], pair.sb, pair.overlap, pair.position));
+        return eq;
+    }
+
+    /*
+        The critical pairs of the left-hand side of directed[b] unified with
+        a non-variable subterm of that of directed[a]. b is renamed apart
+        from a first; the overlap of an equation with itself at the root is
+        trivial and skipped.
+    */
+    void overlaps(TermStore &ts, size_t a, size_t b, vector<CriticalPair> &out) {
+        const Equation &x = directed[a];
+        const Equation &y = directed[b];
+        if (x.proof.size() + y.proof.size() > MAX_PROOF) return;
+        vector<Symbol> vars;
+        get_variables(ts, y.lhs, vars);
+        get_variables(ts, y.rhs, vars);
+        Scope renaming;
+        for (Symbol v : vars) renaming.push_back({ v, ts.make_leaf(UNRES, fresh.next()) });
+        TermId renamed = substitute(ts, y.lhs, renaming);
+
+        FlatTerm flat;
+        flat.assign(ts, x.lhs);
+        for (uint32_t position = 0; position < flat.entries.size(); position++) {
+            if (flat.entries[position].key == FlatTerm::WILDCARD || (a == b && position == 0)) continue;
+            CriticalPair pair;
+            pair.a = a;
+            pair.b = b;
+            if (!unify(ts, flat.entries[position].id, renamed, pair.sa)) continue;
+            for (auto &pr : pair.sa) pr.second = resolve(ts, pr.second, pair.sa);
+            for (auto &pr : renaming) pair.sb.push_back({ pr.first, resolve(ts, pr.second, pair.sa) });
+            pair.overlap = substitute(ts, x.lhs, pair.sa);
+            pair.position = substituted_position(ts, x.lhs, position, pair.sa);
+            pair.eq.lhs = substitute(ts, x.rhs, pair.sa);
+            pair.eq.rhs = apply_at(ts, pair.overlap, pair.position, substitute(ts, y.rhs, pair.sb));
+            if (pair.eq.lhs == pair.eq.rhs || ts[pair.eq.lhs].size + ts[pair.eq.rhs].size > MAX_EQUATION) continue;
+            out.push_back(move(pair));
+        }
+    }
+
+    VariableNameGenerator fresh;  // names variables apart
+};
+
+
+/*
+    Completions by axiom set, so that goals under the same axioms complete
+    them once, whatever order their lemmas come in. The lock only finds an
+    axiom set its slot; the first goal to ask then builds the completion
+    while the goals under the same axioms wait, and goals under other
+    axioms go on. It is built from the axioms in the order of the key, so
+    that it does not depend on which goal came first.
+*/
+class Completions {
+public:
+    const Completion &get(TermStore &ts, const vector<Axiom> &axioms) {
+        vector<pair<string, size_t>> names;
+        for (size_t i = 0; i < axioms.size(); i++) {
+            const Axiom &ax = axioms[i];
+            names.push_back({ ax.name + ':' + to_string(ax.rule_a) + ',' + to_string(ax.rule_b) + ';', i });
+        }
+        sort(names.begin(), names.end());
+        string key;
+        vector<Axiom> sorted;
+        for (auto &name : names) {
+            key += name.first;
+            sorted.push_back(axioms[name.second]);
+        }
+
+        Slot *slot;
+        {
+            lock_guard<mutex> guard(lock);
+            auto &entry = slots[key];
+            if (!entry) entry = make_unique<Slot>();
+            slot = entry.get();
+        }
+        call_once(slot->built, [&] { slot->completion = make_unique<Completion>(ts, sorted); });
+        return *slot->completion;
+    }
+private:
+    struct Slot {
+        once_flag built;
+        unique_ptr<Completion> completion;
+    };
+
+    mutex lock;  // guards slots, not what is in them
+    map<string, unique_ptr<Slot>> slots;
+};
+
+
+/*
+    Equality saturation, for `param search_mode egraph.`. An e-graph keeps
+    classes of terms known to be equal and shares their subterms, so that
+    a rewrite adds a node to a class once instead of a new term in every
+    context the subterm occurs in, and the commutative and associative
+    variants that swamp the searches cost a few nodes each. Rules are
+    matched against whole classes and applied in rounds, at most
+    max_search_depth of them and until MAX_NODES nodes, restoring
+    congruence after each, until start and target share a class.
+
+    Every node is a concrete term of the store, and every union is kept
+    with its reason, a rule applied at the root or congruence of the
+    children, in a proof forest as egg does. The proof of start = target is
+    the path between them in the forest, with each congruence expanded
+    into the proofs of the children, in place.
+*/
+class EGraph {
+public:
+    static const uint32_t NONE = UINT32_MAX;
+    static const uint32_t CONGRUENCE = UINT32_MAX;  // the reason of a union that no rule made
+    static const size_t MAX_PROOF = 1 << 16;        // steps an explanation may take
+
+    // Variables of a pattern bound to classes.
+    typedef vector<pair<Symbol, uint32_t>> Binding;
+
+    explicit EGraph(TermStore &_ts) : ts(_ts) {}
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    uint32_t find(uint32_t id) {
+        while (nodes[id].leader != id) {
+            nodes[id].leader = nodes[nodes[id].leader].leader;
+            id = nodes[id].leader;
+        }
+        return id;
+    }
+
+    // The smallest term known in the class of id.
+    TermId best(uint32_t id) {
+        return nodes[classes[find(id)].best].term;
+    }
+
+    // The node of term t, which is added with its subterms if new.
+    uint32_t add(TermId t) {
+        auto it = index_of.find(t);
+        if (it != index_of.end()) return it->second;
+        Term term = ts[t];
+        uint32_t children[2] = { NONE, NONE };
+        for (int i = 0; i < (int)term.arity; i++) children[i] = add(term.children[i]);
+        uint32_t id = (uint32_t)nodes.size();
+        nodes.push_back({ t, { children[0], children[1] }, id, id, CONGRUENCE });
+        index_of.emplace(t, id);
+        classes.push_back({ { id }, {}, id });
+        for (int i = 0; i < (int)term.arity; i++) classes[find(children[i])].parents.push_back(id);
+        auto [slot, fresh] = memo.emplace(key(id), id);
+        if (!fresh) merge(id, slot->second, CONGRUENCE);
+        return id;
+    }
+
+    // Puts a and b in one class, for the given reason: a rule that rewrites a into b, or CONGRUENCE.
+    bool merge(uint32_t a, uint32_t b, uint32_t reason) {
+        uint32_t ra = find(a), rb = find(b);
+        if (ra == rb) return false;
+        reroot(a);
+        nodes[a].proof_parent = b;
+        nodes[a].reason = reason;
+
+        if (classes[ra].nodes.size() > classes[rb].nodes.size()) swap(ra, rb);
+        nodes[ra].leader = rb;
+        Class &from = classes[ra];
+        Class &into = classes[rb];
+        into.nodes.insert(into.nodes.end(), from.nodes.begin(), from.nodes.end());
+        into.parents.insert(into.parents.end(), from.parents.begin(), from.parents.end());
+        if (ts[nodes[from.best].term].size < ts[nodes[into.best].term].size) into.best = from.best;
+        from = Class();
+        dirty.push_back(rb);
+        return true;
+    }
+
+    /*
+        Restores congruence: nodes with the same symbol over the same
+        classes share a class. Returns false if stop() turned true first,
+        leaving merges that are sound but a graph that is not congruent.
+    */
+    bool rebuild(const function<bool()> &stop = nullptr) {
+        while (!dirty.empty()) {
+            vector<uint32_t> todo;
+            todo.swap(dirty);
+            for (size_t i = 0; i < todo.size(); i++) {
+                if (stop && stop()) {
+                    dirty.insert(dirty.end(), todo.begin() + i, todo.end());
+                    return false;
+                }
+                uint32_t c = todo[i];
+                // merges below may move the list
+                vector<uint32_t> parents = classes[find(c)].parents;
+                for (uint32_t p : parents) {
+                    auto [slot, fresh] = memo.emplace(key(p), p);
+                    if (!fresh) merge(p, slot->second, CONGRUENCE);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Drops the nodes of each class that are the same over its children's classes.
+    void compact() {
+        for (uint32_t c = 0; c < (uint32_t)classes.size(); c++) {
+            if (find(c) != c) continue;
+            vector<pair<Key, uint32_t>> keyed;
+            for (uint32_t n : classes[c].nodes) keyed.push_back({ key(n), n });
+            sort(keyed.begin(), keyed.end(), [](auto &x, auto &y) { return x.first < y.first; });
+            keyed.erase(unique(keyed.begin(), keyed.end(), [](auto &x, auto &y) { return x.first == y.first; }),
+                        keyed.end());
+            classes[c].nodes.clear();
+            for (auto &pr : keyed) classes[c].nodes.push_back(pr.second);
+        }
+    }
+
+    vector<uint32_t> roots() {
+        vector<uint32_t> out;
+        for (uint32_t c = 0; c < (uint32_t)classes.size(); c++) {
+            if (find(c) == c) out.push_back(c);
+        }
+        return out;
+    }
+
+    // Every binding of pattern's variables under which it matches a term of class c.
+    void match(TermId pattern, uint32_t c, vector<Binding> &out) {
+        vector<pair<TermId, uint32_t>> goals = { { pattern, c } };
+        Binding binding;
+        size_t first = out.size();
+        match(goals, binding, out);
+        sort(out.begin() + first, out.end());
+        out.erase(unique(out.begin() + first, out.end()), out.end());
+    }
+
+    /*
+        The steps from the term of a to that of b, each put in context by
+        wrap; ok is false if they run over MAX_PROOF.
+    */
+    void explain(
+        bool &ok,
+        const RuleIndex &rules,
+        uint32_t a,
+        uint32_t b,
+        const function<TermId(TermId)> &wrap,
+        vector<pair<string, TermId>> &out
+    ) {
+        vector<uint32_t> up_a = ancestors(a), up_b = ancestors(b);
+        unordered_map<uint32_t, size_t> on_b;
+        for (size_t j = 0; j < up_b.size(); j++) on_b.emplace(up_b[j], j);
+        size_t i = 0;
+        for (; !on_b.count(up_a[i]); i++) {
+            step(ok, rules, up_a[i], up_a[i + 1], nodes[up_a[i]].reason, wrap, out);
+        }
+        for (size_t j = on_b[up_a[i]]; j-- > 0;) {
+            step(ok, rules, up_b[j + 1], up_b[j], flip(nodes[up_b[j]].reason), wrap, out);
+        }
+    }
+
+private:
+    struct Node {
+        TermId term;
+        uint32_t children[2];  // nodes of the children of term
+        uint32_t leader;       // union-find
+        uint32_t proof_parent; // proof forest: term rewrites into the one of proof_parent,
+        uint32_t reason;       // by this rule, or CONGRUENCE
+    };
+    struct Class {
+        vector<uint32_t> nodes;
+        vector<uint32_t> parents;  // nodes with a child in the class
+        uint32_t best;
+    };
+    struct Key {
+        uint64_t head;
+        uint32_t children[2];
+
+        bool operator==(const Key &o) const {
+            return head == o.head && children[0] == o.children[0] && children[1] == o.children[1];
+        }
+        bool operator<(const Key &o) const {
+            return tie(head, children[0], children[1]) < tie(o.head, o.children[0], o.children[1]);
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &k) const {
+            return mix64(k.head ^ mix64(((uint64_t)k.children[0] << 32) | k.children[1]));
+        }
+    };
+
+    TermStore &ts;
+    vector<Node> nodes;
+    vector<Class> classes;  // by node, of which only those of class leaders are used
+    unordered_map<TermId, uint32_t> index_of;
+    unordered_map<Key, uint32_t, KeyHash> memo;  // canonical nodes
+    vector<uint32_t> dirty;  // classes merged since the last rebuild()
+
+    Key key(uint32_t id) {
+        const Term &t = ts[nodes[id].term];
+        Key k = { FlatTerm::key(t), { NONE, NONE } };
+        if (FlatTerm::key(t) == FlatTerm::WILDCARD) k.head = ((uint64_t)t.type << 40) | t.sym;
+        for (int i = 0; i < (int)t.arity; i++) k.children[i] = find(nodes[id].children[i]);
+        return k;
+    }
+
+    static uint32_t flip(uint32_t reason) {
+        return reason == CONGRUENCE ? reason : reason ^ 1;
+    }
+
+    // Makes x the root of its proof tree, turning the edges on the way around.
+    void reroot(uint32_t x) {
+        uint32_t prev = x, cur = nodes[x].proof_parent, reason = nodes[x].reason;
+        nodes[x].proof_parent = x;
+        while (cur != prev) {
+            uint32_t next = nodes[cur].proof_parent, next_reason = nodes[cur].reason;
+            nodes[cur].proof_parent = prev;
+            nodes[cur].reason = flip(reason);
+            prev = cur;
+            cur = next;
+            reason = next_reason;
+        }
+    }
+
+    vector<uint32_t> ancestors(uint32_t x) {
+        vector<uint32_t> out = { x };
+        while (nodes[x].proof_parent != x) {
+            x = nodes[x].proof_parent;
+            out.push_back(x);
+        }
+        return out;
+    }
+
+    void match(vector<pair<TermId, uint32_t>> &goals, Binding &binding, vector<Binding> &out) {
+        if (goals.empty()) {
+            out.push_back(binding);
+            return;
+        }
+        auto [pattern, c] = goals.back();
+        goals.pop_back();
+        Term p = ts[pattern];
+        if (is_variable(p)) {
+            auto bound = find_if(binding.begin(), binding.end(), [&](auto &pr) { return pr.first == p.sym; });
+            if (bound == binding.end()) {
+                binding.push_back({ p.sym, c });
+                match(goals, binding, out);
+                binding.pop_back();
+            } else if (bound->second == c) {
+                match(goals, binding, out);
+            }
+        } else {
+            for (uint32_t n : classes[c].nodes) {
+                const Term &t = ts[nodes[n].term];
+                if (t.type != p.type || t.sym != p.sym || t.arity != p.arity) continue;
+                size_t depth = goals.size();
+                for (int i = (int)p.arity - 1; i >= 0; i--) goals.push_back({ p.children[i], find(nodes[n].children[i]) });
+                match(goals, binding, out);
+                goals.resize(depth);
+            }
+        }
+        goals.push_back({ pattern, c });
+    }
+
+    // The steps of one edge of the proof forest, from x to y.
+    void step(
+        bool &ok,
+        const RuleIndex &rules,
+        uint32_t x,
+        uint32_t y,
+        uint32_t reason,
+        const function<TermId(TermId)> &wrap,
+        vector<pair<string, TermId>> &out
+    ) {
+        if (!ok) return;
+        if (out.size() >= MAX_PROOF) {
+            ok = false;
+            return;
+        }
+        if (reason != CONGRUENCE) {
+            out.push_back({ rules.rules[reason].name, wrap(nodes[y].term) });
+            return;
+        }
+        // the children are proper subterms, so this bottoms out
+        Term tx = ts[nodes[x].term];
+        Term ty = ts[nodes[y].term];
+        explain(ok, rules, nodes[x].children[0], nodes[y].children[0], [&](TermId c) {
+            return wrap(ts.make(OP, tx.sym, tx.arity, c, tx.children[1]));
+        }, out);
+        if (tx.arity < 2) return;
+        explain(ok, rules, nodes[x].children[1], nodes[y].children[1], [&](TermId c) {
+            return wrap(ts.make(OP, tx.sym, tx.arity, ty.children[0], c));
+        }, out);
+    }
+};
+
+
+// The leaves (variables and primitives) of t, each once.
+void
+get_leaves(const TermStore &ts, TermId t, vector<TermId> &leaves)
+{
+    const Term &term = ts[t];
+    if (term.arity == 0) {
+        if (find(leaves.begin(), leaves.end(), t) == leaves.end()) leaves.push_back(t);
+        return;
+    }
+    for (int i = 0; i < (int)term.arity; i++) get_leaves(ts, term.children[i], leaves);
+}
+
+
+/*
+    The e-graph engine. A variable that only the right-hand side of a rule
+    has, which the searches name afresh, could be any term here; it is
+    instantiated with each leaf of the goal instead, which keeps rounds
+    finite and is what proofs like 1 = (+ x (~ x)) need. Rules are applied
+    to the smallest term of each matched class, and instances wider than
+    max_tree_size are not added, unless as wide as the target.
+*/
+vector<pair<string, TermId>>
+find_shortest_path_egraph(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    int max_depth=4,
+    int max_tree_size=40,
+    SearchBudget *budget=nullptr
+) {
+    static const size_t MAX_NODES = 200000;
+    WidthBound bound = { (uint32_t)max_tree_size, ts[target].width };
+    EGraph graph(ts);
+    uint32_t s = graph.add(start);
+    uint32_t t = graph.add(target);
+
+    // an oriented axiom keeps the slot of its way back, which the index never offers
+    vector<int> live, found;
+    for (int r = 0; r < (int)rules.rules.size(); r++) {
+        rules.candidates(ts, rules.rules[r].from, found);
+        if (binary_search(found.begin(), found.end(), r)) live.push_back(r);
+    }
+    vector<TermId> leaves;
+    get_leaves(ts, start, leaves);
+    get_leaves(ts, target, leaves);
+
+    // a round the budget cuts short still keeps what it merged, but is the last
+    auto spent = [&](int round, size_t frontier) {
+        return budget && budget->spent(round, graph.size(), frontier);
+    };
+    ok = graph.find(s) == graph.find(t);
+    for (int round = 0; !ok && round < max_depth && graph.size() < MAX_NODES; round++) {
+        if (spent(round, 0)) break;
+        graph.compact();
+        vector<tuple<int, EGraph::Binding>> matches;
+        vector<EGraph::Binding> bindings;
+        for (uint32_t c : graph.roots()) {
+            if (spent(round, matches.size())) break;
+            for (int r : live) {
+                bindings.clear();
+                graph.match(rules.rules[r].from, c, bindings);
+                for (auto &binding : bindings) matches.push_back({ r, move(binding) });
+            }
+        }
+
+        bool changed = false;
+        vector<Symbol> vars;
+        for (auto &[r, binding] : matches) {
+            if (graph.size() >= MAX_NODES || spent(round, matches.size())) break;
+            const Rule &rule = rules.rules[r];
+            Scope scope;
+            for (auto &pr : binding) scope.push_back({ pr.first, graph.best(pr.second) });
+            TermId from = substitute(ts, rule.from, scope);
+            size_t bound_vars = scope.size();
+            vars.clear();
+            get_variables(ts, rule.to, vars);
+            for (Symbol v : vars) {
+                if (!scope_find(scope, v)) scope.push_back({ v, leaves[0] });
+            }
+            // every choice of leaves for the new variables, counting in base leaves.size()
+            for (;;) {
+                TermId to = substitute(ts, rule.to, scope);
+                if (bound.allows(ts[to].width)) changed |= graph.merge(graph.add(from), graph.add(to), (uint32_t)r);
+                size_t i = bound_vars;
+                for (; i < scope.size(); i++) {
+                    size_t next = find(leaves.begin(), leaves.end(), scope[i].second) - leaves.begin() + 1;
+                    if (next < leaves.size()) {
+                        scope[i].second = leaves[next];
+                        break;
+                    }
+                    scope[i].second = leaves[0];
+                }
+                if (i == scope.size()) break;
+            }
+        }
+        graph.rebuild([&] { return spent(round, 0); });
+        ok = graph.find(s) == graph.find(t);
+        if (!changed || (budget && budget->exhausted() != SearchBudget::NONE)) break;  // saturated or out of budget
+    }
+    states = (int)graph.size();
+    if (!ok) return {};
+
+    vector<pair<string, TermId>> path;
+    graph.explain(ok, rules, s, t, [](TermId c) { return c; }, path);
+    if (!ok) return {};
+    cut_cycles(start, path);
+    return path;
+}
+
+
+Axiom
+search_axiom(const vector<Axiom> &axioms, string name)
+{
+    for (const Axiom &ax : axioms) {
+        if (ax.name == name) {
+            return ax;
+        }
+    }
+    throw_failure(ProverError::SYNTAX, "search_axiom() :: invalid axiom name.");
+}
+
+
+struct Params {
+    int max_search_depth = 8;
+    int max_tree_size = 20;
+    bool use_proofs_as_axioms = false;
+    bool ac_normalize = false;
+    bool semantic_check = true;
+    bool stats = false;  // print a JSON line of search statistics after each proof
+    bool completion = false;  // try normal forms by a completed rewrite system first
+    int max_lemmas = 0;  // lemmas taking part in a proof, all if 0
+    string lemma_orientation = "both";
+    string proof_cache = "";  // path of the cache file, none if empty
+    string spill_dir = "";    // searches keep their levels on disk here if set
+    int spill_memory = 1024;  // megabytes an external search keeps in memory
+    string workers = "";  // comma-separated host:port of worker processes to search on, if set
+    int time_limit_ms = 0;    // a search gives up after this long, never if 0
+    int memory_limit_mb = 0;  // ... or once the process is this large
+    int progress_ms = 0;      // how often a search reports progress on stderr, never if 0
+    string search_mode = "bfs";
+    int threads = 1;
+    int jobs = 1;
+};
+
+
+struct ProofResult {
+    bool ok;
+    int states;
+    double seconds;
+    vector<pair<string, TermId>> path;
+    bool refuted = false;
+    vector<pair<Symbol, bool>> counterexample;
+    vector<int> levels;  // states reached per depth, by the BFS engines
+    SearchStats stats;   // with `param stats true.` and the bfs engine
+    SearchBudget::Limit exhausted = SearchBudget::NONE;  // the budget that stopped the search, if one did
+    int depth = 0;       // ... and the depth it had reached
+};
+
+
+/*
+    Thread pools by size, created on first use and kept until exit so that
+    goals still running on a pool never see it destroyed.
+*/
+class PoolCache {
+public:
+    ThreadPool &get(int n) {
+        lock_guard<mutex> guard(lock);
+        unique_ptr<ThreadPool> &pool = pools[n];
+        if (!pool) pool = make_unique<ThreadPool>(n);
+        return *pool;
+    }
+private:
+    mutex lock;
+    map<int, unique_ptr<ThreadPool>> pools;
+};
+
+
+/*
+    Persistent proof cache. Each record stores the outcome of one goal
+    under one axiom list and one search configuration, so a later run with
+    the same input replays the stored path instead of searching again.
+    Goals are keyed with their variables numbered by first appearance,
+    which makes goals that only differ in variable names share a record.
+    Any ?N variables the rewrites introduce depend only on the shape of the
+    goal, not on variable names, so the stored path applies to every goal
+    of that shape.
+
+    File layout, little-endian: the magic "PRVCACHE", a u32 version and a
+    u32 record count, then per record a u64 key, the u32 payload length
+    and the payload. A payload holds the key bytes the u64 key hashes,
+    which a lookup compares so that two goals whose keys collide never
+    share a proof, then a u8 success flag, the u32 state count, the u32
+    step count and, per step, the rule name and the term.
+    Strings are a u32 length followed by the bytes. A term is written in
+    preorder as u8 type, u8 arity and either the u32 index of a goal
+    variable or UINT32_MAX followed by the symbol name.
+
+    The file is memory-mapped read-only when it is opened. New records
+    are kept in memory until save() writes the old and new records to a
+    temporary file and renames it over the cache.
+*/
+class CacheWriter {
+public:
+    string bytes;
+
+    void u8(uint8_t v) { bytes.push_back((char)v); }
+    void u32(uint32_t v) { bytes.append((const char *)&v, sizeof(v)); }
+    void u64(uint64_t v) { bytes.append((const char *)&v, sizeof(v)); }
+    void str(const string &s) {
+        u32((uint32_t)s.size());
+        bytes += s;
+    }
+    void term(const TermStore &ts, TermId id, const vector<Symbol> &vars) {
+        const Term &t = ts[id];
+        u8((uint8_t)t.type);
+        u8((uint8_t)t.arity);
+        auto it = find(vars.begin(), vars.end(), t.sym);
+        if (t.type == VAR && it != vars.end()) {
+            u32((uint32_t)(it - vars.begin()));
+        } else {
+            u32(UINT32_MAX);
+            str(ts.symbols.name(t.sym));
+        }
+        for (int i = 0; i < t.arity; i++) {
+            term(ts, t.children[i], vars);
+        }
+    }
+};
+
+
+// Reads what CacheWriter wrote; ok turns false when the data runs out or is malformed.
+class CacheReader {
+public:
+    bool ok;
+
+    CacheReader(const char *_p, const char *_end) : ok(true), p(_p), end(_end) {}
+
+    uint8_t u8() {
+        uint8_t v = 0;
+        read(&v, sizeof(v));
+        return v;
+    }
+    uint32_t u32() {
+        uint32_t v = 0;
+        read(&v, sizeof(v));
+        return v;
+    }
+    uint64_t u64() {
+        uint64_t v = 0;
+        read(&v, sizeof(v));
+        return v;
+    }
+    string str() {
+        uint32_t n = u32();
+        if (!ok || (size_t)(end - p) < n) {
+            ok = false;
+            return "";
+        }
+        string s(p, n);
+        p += n;
+        return s;
+    }
+    TermId term(TermStore &ts, const vector<Symbol> &vars) {
+        NodeType type = (NodeType)u8();
+        int arity = u8();
+        uint32_t var = u32();
+        Symbol sym = 0;
+        if (var != UINT32_MAX) {
+            if (var >= vars.size()) ok = false;
+            if (!ok) return NO_TERM;
+            sym = vars[var];
+        } else {
+            string name = str();
+            if (!ok) return NO_TERM;
+            sym = ts.symbols.intern(name);
+        }
+        if (arity > 2 || (type != OP && arity != 0)) ok = false;
+        TermId children[2] = { 0, 0 };
+        for (int i = 0; i < arity && ok; i++) {
+            children[i] = term(ts, vars);
+        }
+        if (!ok) return NO_TERM;
+        return ts.make(type, sym, arity, children[0], children[1]);
+    }
+    const char *position() const { return p; }
+
+private:
+    const char *p, *end;
+
+    void read(void *out, size_t n) {
+        if (!ok || (size_t)(end - p) < n) {
+            ok = false;
+            return;
+        }
+        memcpy(out, p, n);
+        p += n;
+    }
+};
+
+
+class ProofCache {
+public:
+    static constexpr char MAGIC[9] = "PRVCACHE";
+    static const uint32_t VERSION = 3;
+
+    // An empty path keeps the cache in memory only.
+    ProofCache(const string &_path) : path(_path), data(nullptr), data_size(0), dirty(false) {
+        if (path.empty()) return;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;  // no cache yet
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            data_size = (size_t)st.st_size;
+            void *mem = mmap(nullptr, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = mem == MAP_FAILED ? nullptr : (const char *)mem;
+        }
+        close(fd);
+        if (data && !index_records()) {
+            throw_failure(ProverError::IO, "ProofCache() :: " + path + " is not a proof cache.");
+        }
+    }
+    ~ProofCache() {
+        if (data) munmap((void *)data, data_size);
+    }
+    ProofCache(const ProofCache &) = delete;
+    ProofCache &operator=(const ProofCache &) = delete;
+
+    /*
+        Everything the outcome of a search for start = target depends on,
+        serialized. The lemma params (use_proofs_as_axioms, max_lemmas,
+        lemma_orientation) act through the axioms and their orientation,
+        and semantic_check through refutations, which are never cached.
+        The remaining params (threads, jobs, workers, spill_dir and
+        spill_memory) only change how the same search is run, and the
+        budgets only matter to searches that ran out, which are not kept.
+    */
+    static string key(
+        const TermStore &ts,
+        const vector<Axiom> &axioms,
+        TermId start,
+        TermId target,
+        const vector<Symbol> &vars,
+        const Params &params
+    ) {
+        CacheWriter w;
+        w.u32((uint32_t)params.max_search_depth);
+        w.u32((uint32_t)params.max_tree_size);
+        w.str(params.search_mode);
+        w.u8(params.ac_normalize);
+        w.u8(params.completion);
+        w.u32((uint32_t)axioms.size());
+        for (const Axiom &ax : axioms) {
+            w.str(ax.name);
+            w.term(ts, ax.rule_a, {});
+            w.term(ts, ax.rule_b, {});
+            w.u8(ax.oriented);
+        }
+        w.term(ts, start, vars);
+        w.term(ts, target, vars);
+        return w.bytes;
+    }
+
+    bool lookup(TermStore &ts, const string &key, const vector<Symbol> &vars, ProofResult &result) {
+        uint64_t h = mix64(hash_string(key));
+        lock_guard<mutex> guard(lock);
+        const char *p, *end;
+        auto added_it = added.find(h);
+        if (added_it != added.end()) {
+            p = added_it->second.data();
+            end = p + added_it->second.size();
+        } else {
+            auto it = records.find(h);
+            if (it == records.end()) return false;
+            p = it->second.first;
+            end = p + it->second.second;
+        }
+        CacheReader r(p, end);
+        if (r.str() != key || !r.ok) return false;
+        result.ok = r.u8() != 0;
+        result.states = (int)r.u32();
+        uint32_t steps = r.u32();
+        result.path.clear();
+        for (uint32_t i = 0; i < steps && r.ok; i++) {
+            string rule = r.str();
+            TermId node = r.term(ts, vars);
+            result.path.push_back({ rule, node });
+        }
+        return r.ok;
+    }
+
+    void store(const TermStore &ts, const string &key, const vector<Symbol> &vars, const ProofResult &result) {
+        CacheWriter w;
+        w.str(key);
+        w.u8(result.ok);
+        w.u32((uint32_t)result.states);
+        w.u32((uint32_t)result.path.size());
+        for (auto &step : result.path) {
+            w.str(step.first);
+            w.term(ts, step.second, vars);
+        }
+        uint64_t h = mix64(hash_string(key));
+        lock_guard<mutex> guard(lock);
+        added[h] = move(w.bytes);
+        dirty = true;
+    }
+
+    void save() {
+        lock_guard<mutex> guard(lock);
+        if (!dirty || path.empty()) return;
+        dirty = false;
+        CacheWriter w;
+        w.bytes.append(MAGIC, 8);
+        w.u32(VERSION);
+        size_t count = added.size();
+        for (auto &pr : records) {
+            if (added.find(pr.first) == added.end()) count++;
+        }
+        w.u32((uint32_t)count);
+        for (auto &pr : records) {
+            if (added.find(pr.first) != added.end()) continue;
+            w.u64(pr.first);
+            w.u32(pr.second.second);
+            w.bytes.append(pr.second.first, pr.second.second);
+        }
+        for (auto &pr : added) {
+            w.u64(pr.first);
+            w.str(pr.second);
+        }
+        string tmp = path + ".tmp";
+        ofstream out(tmp, ios::binary | ios::trunc);
+        out.write(w.bytes.data(), (streamsize)w.bytes.size());
+        out.close();
+        if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+            throw_failure(ProverError::IO, "ProofCache::save() :: could not write " + path + ".");
+        }
+    }
+
+private:
+    string path;
+    const char *data;
+    size_t data_size;
+    bool dirty;  // records were added since the last save
+    mutex lock;
+    // key -> payload in the mapped file
+    unordered_map<uint64_t, pair<const char *, uint32_t>> records;
+    // key -> payload found in this run
+    map<uint64_t, string> added;
+
+    bool index_records() {
+        CacheReader r(data, data + data_size);
+        char magic[8];
+        for (char &c : magic) c = (char)r.u8();
+        if (!r.ok || memcmp(magic, MAGIC, 8) != 0) return false;
+        if (r.u32() != VERSION) return true;  // an older layout, rebuilt on save
+        uint32_t count = r.u32();
+        for (uint32_t i = 0; i < count && r.ok; i++) {
+            uint64_t key = r.u64();
+            uint32_t size = r.u32();
+            const char *payload = r.position();
+            if (!r.ok || (size_t)(data + data_size - payload) < size) return false;
+            records[key] = { payload, size };
+            r = CacheReader(payload + size, data + data_size);
+        }
+        return r.ok;
+    }
+};
+
+
+/*
+    Cache files by path, opened on first use and saved together at exit.
+*/
+class ProofCaches {
+public:
+    ProofCache *get(const string &path) {
+        if (path.empty()) return nullptr;
+        lock_guard<mutex> guard(lock);
+        auto it = caches.find(path);
+        if (it != caches.end()) return it->second.get();
+        // only a cache that opened goes in, so a bad file fails every goal that uses it
+        auto cache = make_unique<ProofCache>(path);
+        return (caches[path] = move(cache)).get();
+    }
+    void save() {
+        lock_guard<mutex> guard(lock);
+        for (auto &pr : caches) {
+            if (pr.second) pr.second->save();
+        }
+    }
+private:
+    mutex lock;
+    map<string, unique_ptr<ProofCache>> caches;
+};
+
+
+/*
+    Distributed BFS, for `param workers "host:port,host:port".`, over
+    worker processes started with `prover --worker <port>`. Each state
+    belongs to the worker its term hashes to, which alone keeps it in its
+    share of the visited set, so a cluster holds as many states as its
+    workers together. The search stays level-synchronous: on each level
+    every worker expands the states it owns, sends each successor to its
+    owner in one batch per peer over a mesh of TCP connections, and keeps
+    those it has not seen before. A state's parent is a reference to a
+    state of any worker, and the prover driving the search rebuilds the
+    path by asking owners for one state after another.
+
+    Terms cross by symbol name (see CacheWriter), as every process interns
+    generated variables in its own order; term hashes only depend on
+    names, so all processes agree on owners. The path has the length of
+    find_shortest_path()'s, but states are deduplicated in arrival order
+    within a level, so it can be a different one. A set of workers runs
+    one search at a time, so searches of this process take turns.
+*/
+enum DistributedMessage : uint8_t { JOB, HELLO, LEVEL, LEVEL_DONE, BATCH, STATE, STATE_INFO, END };
+
+// A TCP connection carrying messages framed as a type byte, a 64-bit length and the payload.
+class Channel {
+public:
+    explicit Channel(int _fd) : fd(_fd) {}
+    ~Channel() {
+        if (fd >= 0) close(fd);
+    }
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    bool send(uint8_t type, const string &payload) {
+        char header[9];
+        uint64_t n = payload.size();
+        header[0] = (char)type;
+        memcpy(header + 1, &n, sizeof(n));
+        return write_bytes(header, sizeof(header)) && write_bytes(payload.data(), payload.size());
+    }
+    bool receive(uint8_t &type, string &payload) {
+        char header[9];
+        uint64_t n;
+        if (!read_bytes(header, sizeof(header))) return false;
+        type = (uint8_t)header[0];
+        memcpy(&n, header + 1, sizeof(n));
+        payload.resize(n);
+        return read_bytes(payload.data(), n);
+    }
+
+private:
+    int fd;
+
+    bool write_bytes(const char *p, size_t n) {
+        while (n > 0) {
+            ssize_t done = ::send(fd, p, n, MSG_NOSIGNAL);
+            if (done <= 0) return false;
+            p += done;
+            n -= (size_t)done;
+        }
+        return true;
+    }
+    bool read_bytes(char *p, size_t n) {
+        while (n > 0) {
+            ssize_t done = recv(fd, p, n, 0);
+            if (done <= 0) return false;
+            p += done;
+            n -= (size_t)done;
+        }
+        return true;
+    }
+};
+
+
+// A connection to host:port, or -1.
+int
+connect_tcp(const string &address)
+{
+    size_t colon = address.rfind(':');
+    if (colon == string::npos) return -1;
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *found;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+    int fd = -1;
+    for (addrinfo *a = found; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (fd >= 0) {
+        // batches are written whole, so there is nothing to coalesce
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+
+// The owner, among n workers, of the state of term id.
+uint32_t
+owner_of(const TermStore &ts, TermId id, uint32_t n)
+{
+    return (uint32_t)(mix64(ts.hash(id)) % n);
+}
+
+
+/*
+    A worker process: serves searches one after another, each from the
+    connection of the prover that sent the JOB. Connections that arrive
+    while it is busy, a prover's or a peer's of a later search, wait in
+    line.
+*/
+class DistributedWorker {
+public:
+    static const uint64_t NO_PARENT = UINT64_MAX;
+
+    explicit DistributedWorker(int port) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((uint16_t)port);
+        if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+            throw_failure(ProverError::NETWORK,
+                          "DistributedWorker() :: cannot listen on port " + to_string(port) + ".");
+        }
+    }
+
+    void run() {
+        while (true) {
+            Incoming job = next([](const Incoming &c) { return c.type == JOB; });
+            serve(*job.channel, job.payload);
+        }
+    }
+
+private:
+    struct Incoming {
+        unique_ptr<Channel> channel;
+        uint8_t type;
+        string payload;  // of the first message
+    };
+    struct State {
+        TermId term;
+        uint32_t rule;
+        uint64_t parent;  // owner << 32 | index, or NO_PARENT
+    };
+
+    int listener;
+    deque<Incoming> waiting;
+
+    // The first connection whose first message wanted accepts, accepting more as needed.
+    template <typename Wanted>
+    Incoming next(Wanted wanted) {
+        for (auto it = waiting.begin(); it != waiting.end(); ++it) {
+            if (!wanted(*it)) continue;
+            Incoming c = move(*it);
+            waiting.erase(it);
+            return c;
+        }
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            Incoming c = { make_unique<Channel>(fd), 0, "" };
+            if (!c.channel->receive(c.type, c.payload)) continue;
+            if (wanted(c)) return c;
+            waiting.push_back(move(c));
+        }
+    }
+
+    void serve(Channel &prover, const string &job) {
+        TermStore ts;
+        CacheReader r(job.data(), job.data() + job.size());
+        uint64_t id = r.u64();
+        uint32_t me = r.u32();
+        uint32_t n = r.u32();
+        vector<string> addresses;
+        for (uint32_t i = 0; i < n && r.ok; i++) addresses.push_back(r.str());
+        vector<Axiom> axioms(r.u32());
+        for (Axiom &ax : axioms) {
+            ax.name = r.str();
+            ax.oriented = r.u8();
+            if (r.u8()) ax.builtin = find_builtin_axiom(ax.name);
+            ax.rule_a = r.term(ts, {});
+            ax.rule_b = r.term(ts, {});
+        }
+        TermId start = r.term(ts, {});
+        TermId target = r.term(ts, {});
+        int max_tree_size = (int)r.u32();
+        if (!r.ok || me >= n) return;
+        RuleIndex rules(ts, axioms);
+        WidthBound bound = { (uint32_t)max_tree_size, ts[target].width };
+
+        // the lower of two workers connects, the higher accepts
+        vector<unique_ptr<Channel>> peers(n);
+        for (uint32_t j = 0; j < me; j++) {
+            int fd = connect_tcp(addresses[j]);
+            if (fd < 0) return;
+            peers[j] = make_unique<Channel>(fd);
+            CacheWriter hello;
+            hello.u64(id);
+            hello.u32(me);
+            if (!peers[j]->send(HELLO, hello.bytes)) return;
+        }
+        for (uint32_t j = me + 1; j < n; j++) {
+            Incoming c = next([&](const Incoming &c) {
+                CacheReader h(c.payload.data(), c.payload.data() + c.payload.size());
+                return c.type == HELLO && h.u64() == id && h.u32() == j;
+            });
+            peers[j] = move(c.channel);
+        }
+
+        vector<State> states;
+        TermIndex visited;
+        vector<uint32_t> frontier, next_frontier;
+        uint64_t found = NO_PARENT;
+        // Keeps term as a new state of the next level unless seen before.
+        auto keep = [&](TermId term, uint64_t parent, uint32_t rule) {
+            uint32_t index = (uint32_t)states.size();
+            if (!visited.insert(ts, term, index)) return;
+            states.push_back({ term, rule, parent });
+            next_frontier.push_back(index);
+            if (term == target && found == NO_PARENT) found = ((uint64_t)me << 32) | index;
+        };
+        if (owner_of(ts, start, n) == me) {
+            keep(start, NO_PARENT, SearchState::NO_RULE);
+            frontier.swap(next_frontier);
+        }
+
+        uint8_t type;
+        string payload;
+        vector<Successor> successors;
+        while (prover.receive(type, payload) && type != END) {
+            CacheWriter reply;
+            if (type == STATE) {
+                CacheReader q(payload.data(), payload.data() + payload.size());
+                uint32_t index = (uint32_t)q.u64();
+                if (index >= states.size()) return;
+                reply.term(ts, states[index].term, {});
+                reply.u64(states[index].parent);
+                reply.u32(states[index].rule);
+                if (!prover.send(STATE_INFO, reply.bytes)) return;
+                continue;
+            }
+            if (type != LEVEL) return;
+            CacheReader level(payload.data(), payload.data() + payload.size());
+            level.u32();
+            // the rest of the level is left unexpanded once the prover's time limit is up
+            int64_t left = (int64_t)level.u64();
+            auto deadline = left < 0 ? chrono::steady_clock::time_point::max()
+                                     : chrono::steady_clock::now() + chrono::milliseconds(left);
+
+            vector<CacheWriter> outgoing(n);
+            next_frontier.clear();
+            for (uint32_t index : frontier) {
+                TermId u = states[index].term;
+                if ((int)ts[u].width > max_tree_size) continue;
+                if (chrono::steady_clock::now() >= deadline) break;
+                possible_next_trees(ts, rules, u, successors, bound);
+                for (const Successor &succ : successors) {
+                    TermId v = apply_at(ts, u, succ.position, succ.replacement);
+                    uint32_t owner = owner_of(ts, v, n);
+                    uint64_t parent = ((uint64_t)me << 32) | index;
+                    if (owner == me) {
+                        keep(v, parent, succ.rule);
+                    } else {
+                        outgoing[owner].term(ts, v, {});
+                        outgoing[owner].u64(parent);
+                        outgoing[owner].u32(succ.rule);
+                    }
+                }
+            }
+            // every worker sends while it receives, so nobody waits on a full socket
+            atomic<bool> sent(true);
+            thread sender([&] {
+                for (uint32_t j = 0; j < n; j++) {
+                    if (j != me && !peers[j]->send(BATCH, outgoing[j].bytes)) sent = false;
+                }
+            });
+            bool received = true;
+            for (uint32_t j = 0; j < n && received; j++) {
+                if (j == me) continue;
+                received = peers[j]->receive(type, payload) && type == BATCH;
+                CacheReader batch(payload.data(), payload.data() + payload.size());
+                while (received && batch.position() < payload.data() + payload.size()) {
+                    TermId v = batch.term(ts, {});
+                    uint64_t parent = batch.u64();
+                    uint32_t rule = batch.u32();
+                    if (!batch.ok) break;
+                    keep(v, parent, rule);
+                }
+            }
+            sender.join();
+            if (!sent || !received) return;
+            frontier.swap(next_frontier);
+
+            reply.u64(frontier.size());
+            reply.u64(found);
+            if (!prover.send(LEVEL_DONE, reply.bytes)) return;
+        }
+    }
+};
+
+
+vector<pair<string, TermId>>
+find_shortest_path_distributed(
+    bool &ok,
+    int &states,
+    TermStore &ts,
+    const vector<Axiom> &axioms,
+    const RuleIndex &rules,
+    TermId start,
+    TermId target,
+    const string &workers,
+    int max_depth=4,
+    int max_tree_size=40,
+    SearchBudget *budget=nullptr
+) {
+    ok = start == target;
+    states = 1;
+    if (ok) return {};
+    static mutex one_search;
+    lock_guard<mutex> guard(one_search);
+
+    vector<string> addresses;
+    stringstream list(workers);
+    for (string address; getline(list, address, ',');) {
+        if (!address.empty()) addresses.push_back(address);
+    }
+    uint32_t n = (uint32_t)addresses.size();
+    if (n == 0) {
+        throw_failure(ProverError::SYNTAX,
+                      "find_shortest_path_distributed() :: no workers in \"" + workers + "\".");
+    }
+    vector<unique_ptr<Channel>> channels;
+    for (const string &address : addresses) {
+        int fd = connect_tcp(address);
+        if (fd < 0) {
+            throw_failure(ProverError::NETWORK,
+                          "find_shortest_path_distributed() :: cannot connect to worker " + address + ".");
+        }
+        channels.push_back(make_unique<Channel>(fd));
+    }
+    uint8_t type;
+    string payload;
+    auto lost = [&](uint32_t i) {
+        throw_failure(ProverError::NETWORK,
+                      "find_shortest_path_distributed() :: lost worker " + addresses[i] + ".");
+    };
+    auto send_to = [&](uint32_t i, uint8_t request, const string &body) {
+        if (!channels[i]->send(request, body)) lost(i);
+    };
+    auto receive_from = [&](uint32_t i, uint8_t expected) {
+        if (!channels[i]->receive(type, payload) || type != expected) lost(i);
+        return CacheReader(payload.data(), payload.data() + payload.size());
+    };
+
+    CacheWriter job;
+    job.u32(n);
+    for (const string &address : addresses) job.str(address);
+    job.u32((uint32_t)axioms.size());
+    for (const Axiom &ax : axioms) {
+        job.str(ax.name);
+        job.u8(ax.oriented);
+        job.u8(ax.builtin != nullptr);
+        job.term(ts, ax.rule_a, {});
+        job.term(ts, ax.rule_b, {});
+    }
+    job.term(ts, start, {});
+    job.term(ts, target, {});
+    job.u32((uint32_t)max_tree_size);
+    // tells this search's peer connections from those of anyone else's
+    uint64_t id = mix64(random_device()() ^ (uint64_t)chrono::steady_clock::now().time_since_epoch().count());
+    for (uint32_t i = 0; i < n; i++) {
+        CacheWriter w;
+        w.u64(id);
+        w.u32(i);
+        send_to(i, JOB, w.bytes + job.bytes);
+    }
+
+    uint64_t found = DistributedWorker::NO_PARENT;
+    uint64_t frontier = 1;
+    for (int depth = 0; depth < max_depth && found == DistributedWorker::NO_PARENT; depth++) {
+        // workers get the time left with each level and stop expanding when it is up
+        if (budget && budget->spent(depth, states, frontier)) break;
+        // a worker only answers once its peers have exchanged the level too
+        CacheWriter w;
+        w.u32((uint32_t)depth);
+        w.u64((uint64_t)(budget ? budget->remaining_ms() : -1));
+        for (uint32_t i = 0; i < n; i++) send_to(i, LEVEL, w.bytes);
+        uint64_t reached = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            CacheReader r = receive_from(i, LEVEL_DONE);
+            reached += r.u64();
+            uint64_t at = r.u64();
+            if (found == DistributedWorker::NO_PARENT) found = at;
+        }
+        states += (int)reached;
+        frontier = reached;
+        // a level the time limit cut short may have missed the target, so it does not count
+        if (budget && budget->spent(depth, states, frontier)) {
+            found = DistributedWorker::NO_PARENT;
+            break;
+        }
+        if (reached == 0) break;
+    }
+
+    vector<pair<string, TermId>> path;
+    ok = found != DistributedWorker::NO_PARENT;
+    for (uint64_t at = found; at != DistributedWorker::NO_PARENT;) {
+        CacheWriter w;
+        w.u64(at & UINT32_MAX);
+        uint32_t owner = (uint32_t)(at >> 32);
+        if (owner >= n) {
+            throw_failure(ProverError::NETWORK, "find_shortest_path_distributed() :: bad state from a worker.");
+        }
+        send_to(owner, STATE, w.bytes);
+        CacheReader r = receive_from(owner, STATE_INFO);
+        TermId term = r.term(ts, {});
+        at = r.u64();
+        uint32_t rule = r.u32();
+        if (at != DistributedWorker::NO_PARENT) path.push_back({ rules.rules[rule].name, term });
+    }
+    reverse(path.begin(), path.end());
+    for (uint32_t i = 0; i < n; i++) send_to(i, END, "");
+    return path;
+}
+
+
+ProofResult
+prove(
+    TermStore &ts,
+    const vector<Axiom> &axioms,
+    TermId start,
+    TermId target,
+    const Params &params,
+    PoolCache &search_pools,
+    ProofCache *cache,
+    const RuleIndex *compiled = nullptr,  // the rules of axioms when they are already built
+    Completions *completions = nullptr    // completed axiom sets, completed here if null
+) {
+    ProofResult result;
+    auto st_clock = chrono::high_resolution_clock::now();
+
+    if (params.semantic_check && refute_goal(ts, axioms, start, target, result.counterexample)) {
+        result.ok = false;
+        result.refuted = true;
+        result.states = 0;
+        result.stats.engine = "semantic";
+        auto en_clock = chrono::high_resolution_clock::now();
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(en_clock - st_clock);
+        result.seconds = ((double)elapsed.count()) / 1000.0;
+        return result;
+    }
+
+    vector<Symbol> vars;
+    string key;
+    if (cache) {
+        get_variables(ts, start, vars);
+        get_variables(ts, target, vars);
+        key = ProofCache::key(ts, axioms, start, target, vars, params);
+        if (cache->lookup(ts, key, vars, result)) {
+            result.stats.engine = "cache";
+            auto en_clock = chrono::high_resolution_clock::now();
+            auto elapsed = chrono::duration_cast<chrono::milliseconds>(en_clock - st_clock);
+            result.seconds = ((double)elapsed.count()) / 1000.0;
+            return result;
+        }
+    }
+
+    unique_ptr<RuleIndex> own_rules;
+    if (!compiled) own_rules = make_unique<RuleIndex>(ts, axioms);
+    const RuleIndex &rules = compiled ? *compiled : *own_rules;
+
+    // Terms and bookkeeping created by the search live in a per-proof
+    // overlay store and arena that are released in one go on return; only
+    // the terms of the proof path are copied back into the shared store.
+    TermStore local(&ts);
+    pmr::monotonic_buffer_resource arena;
+    SearchBudget budget(params.time_limit_ms, params.memory_limit_mb, params.progress_ms,
+                        to_string(ts, start) + " = " + to_string(ts, target));
+
+    unique_ptr<Completion> own_completion;
+    const Completion *completion = nullptr;
+    if (params.completion) {
+        if (completions) {
+            completion = &completions->get(ts, axioms);
+        } else {
+            own_completion = make_unique<Completion>(ts, axioms);
+            completion = own_completion.get();
+        }
+    }
+
+    if (completion && completion->prove(local, start, target, result.path, result.states)) {
+        result.ok = true;
+        result.stats.engine = "completion";
+    } else if (params.search_mode == "ida_star") {
+        result.stats.engine = "ida_star";
+        // makes its own overlay per iteration
+        result.path = find_shortest_path_ida_star(result.ok, result.states, ts, rules, start, target,
+                                                  params.max_search_depth, params.max_tree_size, &budget);
+    } else if (params.search_mode == "best_first") {
+        result.stats.engine = "best_first";
+        ThreadPool &pool = search_pools.get(params.threads - 1);
+        result.path = find_shortest_path_stealing(result.ok, result.states, local, rules, start, target, pool,
+                                                  params.max_search_depth, params.max_tree_size, &budget);
+    } else if (params.search_mode == "egraph") {
+        result.stats.engine = "egraph";
+        result.path = find_shortest_path_egraph(result.ok, result.states, local, rules, start, target,
+                                                params.max_search_depth, params.max_tree_size, &budget);
+    } else if (params.search_mode == "bidirectional") {
+        result.stats.engine = "bidirectional";
+        result.path = find_shortest_path_bidirectional(result.ok, result.states, local, rules, start, target,
+                                                       params.max_search_depth, params.max_tree_size, &arena,
+                                                       &budget);
+    } else if (params.ac_normalize) {
+        result.stats.engine = "ac";
+        result.path = find_shortest_path_ac(result.ok, result.states, local, rules, start, target,
+                                            params.max_search_depth, params.max_tree_size, &arena,
+                                            &result.levels, &budget);
+    } else if (!params.workers.empty()) {
+        result.stats.engine = "distributed";
+        result.path = find_shortest_path_distributed(result.ok, result.states, local, axioms, rules, start, target,
+                                                     params.workers, params.max_search_depth,
+                                                     params.max_tree_size, &budget);
+    } else if (!params.spill_dir.empty()) {
+        result.stats.engine = "external";
+        // makes its own overlays as it streams the levels
+        result.path = find_shortest_path_external(result.ok, result.states, ts, rules, start, target,
+                                                  params.spill_dir, (size_t)params.spill_memory << 20,
+                                                  params.max_search_depth, params.max_tree_size, &budget);
+    } else if (params.threads > 1) {
+        result.stats.engine = "parallel";
+        // the calling thread works too, so the pool needs one less
+        ThreadPool &pool = search_pools.get(params.threads - 1);
+        result.path = find_shortest_path_parallel(result.ok, result.states, local, rules, start, target, pool,
+                                                  params.max_search_depth, params.max_tree_size, &arena,
+                                                  &result.levels, &budget);
+    } else {
+        if (params.stats) {
+            result.path = find_shortest_path<true>(result.ok, result.states, local, rules, start, target,
+                                                   params.max_search_depth, params.max_tree_size, &arena,
+                                                   &result.levels, &result.stats, &budget);
+        } else {
+            result.path = find_shortest_path(result.ok, result.states, local, rules, start, target,
+                                             params.max_search_depth, params.max_tree_size, &arena,
+                                             &result.levels, nullptr, &budget);
+        }
+    }
+    for (auto &step : result.path) {
+        step.second = copy_term(ts, local, step.second);
+    }
+    result.exhausted = budget.exhausted();
+    result.depth = budget.depth();
+    // what a search cut short found depends on the machine and its load, so it is not kept
+    if (cache && result.exhausted == SearchBudget::NONE) {
+        cache->store(ts, key, vars, result);
+    }
+    auto en_clock = chrono::high_resolution_clock::now();
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(en_clock - st_clock);
+    result.seconds = ((double)elapsed.count()) / 1000.0;
+    return result;
+}
+
+
+string
+format_goal(const TermStore &ts, TermId start, TermId target)
+{
+    return "Prove " + to_string(ts, start) + " = " + to_string(ts, target) + "...\n";
+}
+
+
+// Writes s as a JSON string literal.
+void
+write_json_string(ostream &out, string_view s)
+{
+    out << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if ((unsigned char)c < 0x20) {
+            out << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 15];
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+
+/*
+    The stats report of one proof, as a single line of JSON:
+
+    {"start": "...", "engine": "bfs", "ok": true, "steps": 3, "states": 22,
+     "seconds": 0.001, "expanded": 9, "generated": 40, "duplicates": 18,
+     "cut_by_size": 0, "pruned_by_size": 0, "cut_by_depth": 0,
+     "phase_seconds": {"match": ..., "substitute": ..., ...},
+     "rules": [{"name": "ax1", "reversed": false, "fires": 4}, ...], "frontier": [1, 4, 17]}
+
+    Only the serial bfs engine fills in the counters, phase times and rule
+    fires; the other engines report zeros there ("frontier" also comes
+    from the ac and parallel engines). Rules that never fired are left out,
+    and "reversed" marks an axiom used right to left.
+*/
+string
+format_stats(const TermStore &ts, TermId start, const Params &params, const ProofResult &result)
+{
+    const SearchStats &stats = result.stats;
+    stringstream out;
+    out << "{\"start\": ";
+    write_json_string(out, to_string(ts, start));
+    out << ", \"engine\": \"" << stats.engine << "\""
+        << ", \"ok\": " << (result.ok ? "true" : "false");
+    if (result.exhausted != SearchBudget::NONE) {
+        out << ", \"exhausted\": \"" << (result.exhausted == SearchBudget::TIME ? "time" : "memory") << "\"";
+    }
+    out << ", \"steps\": " << result.path.size()
+        << ", \"states\": " << result.states
+        << ", \"seconds\": " << setprecision(3) << fixed << result.seconds
+        << ", \"max_search_depth\": " << params.max_search_depth
+        << ", \"expanded\": " << stats.expanded
+        << ", \"generated\": " << stats.generated
+        << ", \"duplicates\": " << stats.duplicates
+        << ", \"cut_by_size\": " << stats.cut_by_size
+        << ", \"pruned_by_size\": " << stats.pruned_by_size
+        << ", \"cut_by_depth\": " << stats.cut_by_depth
+        << ", \"phase_seconds\": {";
+    out << setprecision(6);
+    for (int phase = 0; phase < SearchStats::PHASES; phase++) {
+        out << (phase ? ", " : "") << '"' << SearchStats::phase_name(phase) << "\": "
+            << (double)stats.nanoseconds[phase] / 1e9;
+    }
+    out << "}, \"rules\": [";
+    bool first = true;
+    for (size_t r = 0; r < stats.fires.size(); r++) {
+        if (stats.fires[r] == 0) continue;
+        out << (first ? "" : ", ") << "{\"name\": ";
+        write_json_string(out, stats.rule_names[r]);
+        out << ", \"reversed\": " << (r % 2 ? "true" : "false")
+            << ", \"fires\": " << stats.fires[r] << "}";
+        first = false;
+    }
+    const vector<int> &frontier = stats.frontier.empty() ? result.levels : stats.frontier;
+    out << "], \"frontier\": [";
+    for (size_t d = 0; d < frontier.size(); d++) {
+        out << (d ? ", " : "") << frontier[d];
+    }
+    out << "]}";
+    return out.str();
+}
+
+
+string
+format_result(const TermStore &ts, TermId start, const Params &params, const ProofResult &result)
+{
+    stringstream out;
+    if (result.ok) {
+        if (0 == (int)result.path.size()) {
+            out << "Statements are the same." << endl;
+        } else {
+            out << to_string(ts, start) << endl;
+            for (auto &pr : result.path) {
+                TermId node = pr.second;
+                const string &rule_name = pr.first;
+                out << " = " << to_string(ts, node) << "  w/ " << rule_name << endl;
+            }
+            out << "Done in " << setprecision(3) << fixed << result.seconds
+                << " seconds after checking " << result.states << " states." << endl;
+        }
+    } else if (result.refuted) {
+        out << "Not valid: the sides differ";
+        for (size_t i = 0; i < result.counterexample.size(); i++) {
+            const auto &pr = result.counterexample[i];
+            out << (i == 0 ? " when " : ", ") << ts.symbols.name(pr.first) << " = " << (pr.second ? 1 : 0);
+        }
+        out << " (refuted in " << setprecision(3) << fixed << result.seconds << " seconds)." << endl;
+    } else if (result.exhausted != SearchBudget::NONE) {
+        out << "Budget exhausted: "
+            << (result.exhausted == SearchBudget::TIME ? "time_limit_ms " + to_string(params.time_limit_ms)
+                                                       : "memory_limit_mb " + to_string(params.memory_limit_mb))
+            << " reached at depth " << result.depth << " after checking " << result.states << " states in "
+            << setprecision(3) << fixed << result.seconds << " seconds." << endl;
+    } else {
+        out << "No path found within " << params.max_search_depth
+            << " steps after checking " << result.states << " states in "
+            << setprecision(3) << fixed << result.seconds << " seconds." << endl;
+    }
+    if (params.stats) {
+        out << format_stats(ts, start, params, result) << endl;
+    }
+    return out.str();
+}
+
+
+/*
+    The axiom a proven goal becomes. With shrink, a lemma whose sides differ
+    in size only rewrites the larger side into the smaller one.
+*/
+Axiom
+lemma_axiom(const TermStore &ts, TermId start, TermId target, bool shrink)
+{
+    bool grows = ts[start].width < ts[target].width;
+    return {
+        .name = "proof of " + to_string(ts, start) + " = " + to_string(ts, target),
+        .rule_a = shrink && grows ? target : start,
+        .rule_b = shrink && grows ? start : target,
+        .oriented = shrink && ts[start].width != ts[target].width
+    };
+}
+
+
+void
+get_constants(const TermStore &ts, TermId id, set<Symbol> &constants)
+{
+    const Term &t = ts[id];
+    if (t.type == OP || t.type == PRIM) {
+        constants.insert(t.sym);
+    }
+    for (int i = 0; i < t.arity; i++) {
+        get_constants(ts, t.children[i], constants);
+    }
+}
+
+
+bool
+includes_all(const set<Symbol> &closure, const set<Symbol> &constants)
+{
+    return includes(closure.begin(), closure.end(), constants.begin(), constants.end());
+}
+
+
+/*
+    Which of `rules` could ever be applied while proving start = target.
+
+    A rule side only matches terms that contain each of its operator and
+    primitive symbols (its variables match anything). Starting from the
+    symbols of the goal, the symbols of a side are added to the closure
+    whenever the opposite side could match, until nothing changes; a rule
+    neither of whose sides falls inside the closure can never fire.
+*/
+vector<bool>
+rules_that_could_fire(const TermStore &ts, const vector<Axiom> &rules, TermId start, TermId target)
+{
+    vector<pair<set<Symbol>, set<Symbol>>> sides(rules.size());
+    for (size_t i = 0; i < rules.size(); i++) {
+        get_constants(ts, rules[i].rule_a, sides[i].first);
+        get_constants(ts, rules[i].rule_b, sides[i].second);
+    }
+    set<Symbol> closure;
+    get_constants(ts, start, closure);
+    get_constants(ts, target, closure);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto &pr : sides) {
+            size_t before = closure.size();
+            if (includes_all(closure, pr.first)) closure.insert(pr.second.begin(), pr.second.end());
+            if (includes_all(closure, pr.second)) closure.insert(pr.first.begin(), pr.first.end());
+            changed = changed || closure.size() != before;
+        }
+    }
+
+    vector<bool> could_fire(rules.size());
+    for (size_t i = 0; i < rules.size(); i++) {
+        could_fire[i] = includes_all(closure, sides[i].first) || includes_all(closure, sides[i].second);
+    }
+    return could_fire;
+}
+
+
+/*
+    A `prove` command waiting to run. `library` is a snapshot of the axioms
+    and lemmas visible to it in file order; lemma_of[i] is the goal the
+    i-th entry was proven by (-1 for axioms), and it only takes part if
+    that proof succeeds.
+*/
+struct Goal {
+    TermId start, target;
+    Params params;
+    vector<Axiom> library;
+    vector<int> lemma_of;
+    shared_future<ProofResult> result;
+};
+
+
+/*
+    Runs goals in file order, or on a pool of params.jobs workers when that
+    is above 1, and prints their results in file order either way. A goal
+    only waits for the earlier goals whose lemmas could fire while it is
+    searched; without use_proofs_as_axioms, goals never wait on each other.
+    The size of the goal pool is fixed by the first goal that uses it. A
+    goal that fails with an error stops the printing there, and check()
+    throws its error.
+*/
+class GoalScheduler {
+public:
+    GoalScheduler(TermStore &_ts, ostream &_out, ProofCaches &_proof_caches, Completions &_completions,
+                  PoolCache &_search_pools)
+        : ts(_ts), out(_out), proof_caches(_proof_caches), completions(_completions), search_pools(_search_pools),
+          goal_pool(nullptr) {}
+
+    void submit(TermId start, TermId target, const Params &params, const vector<Axiom> &library,
+                const vector<int> &lemma_of) {
+        Goal goal = { start, target, params, {}, {}, {} };
+        vector<bool> could_fire = rules_that_could_fire(ts, library, start, target);
+        vector<shared_future<ProofResult>> deps;
+        for (size_t i = 0; i < library.size(); i++) {
+            if (lemma_of[i] >= 0 && !could_fire[i]) continue;
+            goal.library.push_back(library[i]);
+            goal.lemma_of.push_back(lemma_of[i]);
+            if (lemma_of[i] >= 0) {
+                lock_guard<mutex> guard(lock);
+                deps.push_back(goals[lemma_of[i]].result);
+            }
+        }
+
+        auto run = [this, goal, deps]() {
+            // Lemmas are ranked by how many steps of the proofs they come
+            // from used them, and go before the axioms so that their
+            // rewrites are tried first.
+            map<string, int> uses;
+            for (auto &dep : deps) {
+                for (auto &step : dep.get().path) uses[step.first]++;
+            }
+            vector<Axiom> axioms, lemmas;
+            for (size_t i = 0, d = 0; i < goal.library.size(); i++) {
+                if (goal.lemma_of[i] < 0) {
+                    axioms.push_back(goal.library[i]);
+                } else if (deps[d++].get().ok) {
+                    lemmas.push_back(goal.library[i]);
+                }
+            }
+            stable_sort(lemmas.begin(), lemmas.end(), [&uses](const Axiom &a, const Axiom &b) {
+                return uses[a.name] > uses[b.name];
+            });
+            if (goal.params.max_lemmas > 0 && (int)lemmas.size() > goal.params.max_lemmas) {
+                lemmas.resize(goal.params.max_lemmas);
+            }
+            axioms.insert(axioms.begin(), lemmas.begin(), lemmas.end());
+            return prove(ts, axioms, goal.start, goal.target, goal.params, search_pools,
+                         proof_caches.get(goal.params.proof_cache), nullptr, &completions);
+        };
+
+        if (params.jobs > 1) {
+            if (!goal_pool) goal_pool = &goal_pools.get(params.jobs);
+            auto task = make_shared<packaged_task<ProofResult()>>(run);
+            goal.result = task->get_future().share();
+            {
+                lock_guard<mutex> guard(lock);
+                goals.push_back(goal);
+                if (!printer.joinable()) printer = thread([this] { print_loop(); });
+            }
+            changed.notify_all();
+            goal_pool->submit([task] { (*task)(); });
+        } else {
+            // run inline once every earlier goal is out, printing the goal
+            // before its search starts; a pooled goal that failed is never
+            // printed, so its error is thrown here instead
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [this] { return failure || next_to_print == goals.size(); });
+            if (failure) rethrow_exception(failure);
+            guard.unlock();
+            out << format_goal(ts, start, target) << flush;
+            promise<ProofResult> done;
+            done.set_value(run());
+            goal.result = done.get_future().share();
+            out << format_result(ts, start, params, goal.result.get()) << flush;
+            guard.lock();
+            goals.push_back(goal);
+            release(goals.back());
+            next_to_print++;
+        }
+    }
+
+    int size() {
+        lock_guard<mutex> guard(lock);
+        return (int)goals.size();
+    }
+
+    // Whether a finished goal succeeded; known for lemmas only, see release().
+    bool proved(int goal) {
+        lock_guard<mutex> guard(lock);
+        return goals[goal].result.valid() && goals[goal].result.get().ok;
+    }
+
+    // Rethrows the error of a pooled goal that failed, if one did.
+    void check() {
+        lock_guard<mutex> guard(lock);
+        if (failure) rethrow_exception(failure);
+    }
+
+    // Waits until every goal has been printed, or one has failed.
+    void finish() {
+        {
+            lock_guard<mutex> guard(lock);
+            closing = true;
+        }
+        changed.notify_all();
+        if (printer.joinable()) printer.join();
+    }
+
+    ~GoalScheduler() {
+        finish();
+    }
+
+private:
+    TermStore &ts;
+    ostream &out;
+    mutex lock;  // guards goals, next_to_print, closing and failure
+    condition_variable changed;
+    deque<Goal> goals;
+    size_t next_to_print = 0;
+    bool closing = false;
+    exception_ptr failure;
+    thread printer;
+    // the prover's, so they outlive the goal pool's workers
+    ProofCaches &proof_caches;
+    Completions &completions;
+    PoolCache &search_pools;
+    PoolCache goal_pools;
+    ThreadPool *goal_pool;
+
+    /*
+        Prints pooled goals in file order as soon as each one and all
+        before it are done, so results stream out while input is still
+        being read.
+    */
+    void print_loop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            changed.wait(guard, [this] { return closing || next_to_print < goals.size(); });
+            if (next_to_print == goals.size()) break;
+            Goal &goal = goals[next_to_print];  // deque elements stay put
+            guard.unlock();
+            goal.result.wait();
+            try {
+                out << format_goal(ts, goal.start, goal.target)
+                    << format_result(ts, goal.start, goal.params, goal.result.get()) << flush;
+            } catch (const ProverFailure &) {
+                guard.lock();
+                failure = current_exception();
+                changed.notify_all();
+                break;
+            }
+            guard.lock();
+            release(goal);
+            next_to_print++;
+            changed.notify_all();
+        }
+    }
+
+    // Drops what a printed goal no longer needs; only lemmas keep their results.
+    void release(Goal &goal) {
+        vector<Axiom>().swap(goal.library);
+        vector<int>().swap(goal.lemma_of);
+        if (!goal.params.use_proofs_as_axioms) goal.result = {};
+    }
+};
+
+
+void
+apply_param(Params &params, const Node &cmd)
+{
+    if (cmd.token == "max_search_depth") {
+        params.max_search_depth = stoi(cmd.children[0].token);
+    } else if (cmd.token == "max_tree_size") {
+        params.max_tree_size = stoi(cmd.children[0].token);
+    } else if (cmd.token == "threads") {
+        params.threads = max(1, stoi(cmd.children[0].token));
+    } else if (cmd.token == "jobs") {
+        params.jobs = max(1, stoi(cmd.children[0].token));
+    } else if (cmd.token == "use_proofs_as_axioms") {
+        params.use_proofs_as_axioms = cmd.children[0].token == "true";
+    } else if (cmd.token == "ac_normalize") {
+        params.ac_normalize = cmd.children[0].token == "true";
+    } else if (cmd.token == "semantic_check") {
+        params.semantic_check = cmd.children[0].token == "true";
+    } else if (cmd.token == "stats") {
+        params.stats = cmd.children[0].token == "true";
+    } else if (cmd.token == "completion") {
+        params.completion = cmd.children[0].token == "true";
+    } else if (cmd.token == "proof_cache") {
+        params.proof_cache = cmd.children[0].token;
+    } else if (cmd.token == "spill_dir") {
+        params.spill_dir = cmd.children[0].token;
+    } else if (cmd.token == "workers") {
+        params.workers = cmd.children[0].token;
+    } else if (cmd.token == "spill_memory") {
+        params.spill_memory = stoi(cmd.children[0].token);
+    } else if (cmd.token == "time_limit_ms") {
+        params.time_limit_ms = stoi(cmd.children[0].token);
+    } else if (cmd.token == "memory_limit_mb") {
+        params.memory_limit_mb = stoi(cmd.children[0].token);
+    } else if (cmd.token == "progress_ms") {
+        params.progress_ms = stoi(cmd.children[0].token);
+    } else if (cmd.token == "max_lemmas") {
+        params.max_lemmas = stoi(cmd.children[0].token);
+    } else if (cmd.token == "lemma_orientation") {
+        params.lemma_orientation = cmd.children[0].token;
+    } else if (cmd.token == "search_mode") {
+        params.search_mode = cmd.children[0].token;
+    } else {
+        throw_failure(ProverError::SYNTAX, "apply_param() :: unexpected parameter " + cmd.token);
+    }
+}
+
+
+/*
+    Buffered line reads from a file descriptor, for the server's line
+    protocol.
+*/
+class LineReader {
+public:
+    LineReader(int _fd) : fd(_fd) {}
+
+    bool next(string &line) {
+        while (true) {
+            size_t end = buffer.find('\n');
+            if (end != string::npos) {
+                line = buffer.substr(0, end);
+                buffer.erase(0, end + 1);
+                return true;
+            }
+            char chunk[4096];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n <= 0) {
+                // a last line without its newline still counts
+                line.swap(buffer);
+                buffer.clear();
+                return !line.empty();
+            }
+            buffer.append(chunk, (size_t)n);
+        }
+    }
+
+private:
+    int fd;
+    string buffer;
+};
+
+
+bool
+write_all(int fd, const string &data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) n = write(fd, data.data() + done, data.size() - done);
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+
+/*
+    Daemon mode, started with `prover --serve <file> <socket>`. The file is
+    run as usual, and its axioms and proven lemmas then stay loaded, with
+    their rule index built once. Clients connect to the Unix socket, or use
+    stdin and stdout when the socket is "-", and send one or more
+    `prove` or `param` commands per line. Each line is answered with what
+    running it would print, followed by a line holding a single ".".
+    Params set by a client only apply to that client. Connections are
+    served concurrently, each on its own thread. Results are kept in a
+    proof cache shared by all clients: the prover's cache of the file
+    named by the session's `proof_cache` param, or one in memory when it
+    is empty. On a socket, the caches are saved every few seconds while
+    results come in, and once more when SIGINT or SIGTERM stops the
+    server, after the clients still connected have been hung up on.
+*/
+class ProofServer {
+public:
+    static const int SAVE_SECONDS = 5;
+
+    ProofServer(TermStore &_ts, const Params &_params, const vector<Axiom> &_axioms, ProofCaches &_caches,
+                Completions &_completions, PoolCache &_search_pools)
+        : ts(_ts), params(_params), axioms(_axioms), rules(_ts, _axioms), caches(_caches), memory(""),
+          completions(_completions), search_pools(_search_pools) {}
+
+    // Answers the requests of one client until it hangs up.
+    void serve(int in_fd, int out_fd) {
+        Params session = params;
+        LineReader reader(in_fd);
+        string line;
+        while (reader.next(line)) {
+            string reply;
+            try {
+                reply = answer(line, session);
+            } catch (const ProverFailure &failure) {
+                // one goal going wrong ends neither the session nor the server
+                reply = failure.message + "\n";
+            }
+            if (!write_all(out_fd, reply + ".\n")) break;
+        }
+    }
+
+    void listen_on(const string &path) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (fd < 0 || path.size() >= sizeof(addr.sun_path)) {
+            throw_failure(ProverError::NETWORK, "ProofServer::listen_on() :: cannot create socket " + path + ".");
+        }
+        path.copy(addr.sun_path, path.size());
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+            throw_failure(ProverError::NETWORK, "ProofServer::listen_on() :: cannot listen on " + path + ".");
+        }
+
+        stopping = 0;
+        struct sigaction action = {}, old_int, old_term;
+        action.sa_handler = [](int) { stopping = 1; };
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &old_int);
+        sigaction(SIGTERM, &action, &old_term);
+
+        // the poll timeout also paces the saves, and lets a signal that
+        // went to a client thread be seen here
+        auto saved = chrono::steady_clock::now();
+        while (!stopping) {
+            pollfd listener = { fd, POLLIN, 0 };
+            if (poll(&listener, 1, 1000) > 0) {
+                int client = accept(fd, nullptr, nullptr);
+                if (client >= 0) start_client(client);
+            }
+            if (chrono::steady_clock::now() - saved >= chrono::seconds(SAVE_SECONDS)) {
+                saved = chrono::steady_clock::now();
+                try {
+                    caches.save();
+                } catch (const ProverFailure &) {
+                    // tried again in a while, and by the save once stopped
+                }
+            }
+        }
+        close(fd);
+        unlink(path.c_str());
+        sigaction(SIGINT, &old_int, nullptr);
+        sigaction(SIGTERM, &old_term, nullptr);
+
+        unique_lock<mutex> guard(clients_lock);
+        for (int client : clients) shutdown(client, SHUT_RDWR);
+        clients_done.wait(guard, [this] { return clients.empty(); });
+        guard.unlock();
+        caches.save();
+    }
+
+private:
+    TermStore &ts;
+    Params params;
+    vector<Axiom> axioms;
+    RuleIndex rules;
+    ProofCaches &caches;
+    ProofCache memory;  // for sessions without a proof_cache file
+    Completions &completions;
+    PoolCache &search_pools;
+    mutex clients_lock;  // guards clients
+    condition_variable clients_done;
+    set<int> clients;  // sockets being served
+
+    static volatile sig_atomic_t stopping;
+
+    void start_client(int client) {
+        {
+            lock_guard<mutex> guard(clients_lock);
+            clients.insert(client);
+        }
+        thread([this, client] {
+            serve(client, client);
+            lock_guard<mutex> guard(clients_lock);
+            close(client);
+            clients.erase(client);
+            clients_done.notify_all();
+        }).detach();
+    }
+
+    string answer(const string &line, Params &session) {
+        istringstream in(line);
+        Tokenizer tokenizer(in, false);
+        string out;
+        while (!tokenizer.done()) {
+            Node cmd = parse_command(tokenizer, &ts);
+            if (tokenizer.failed) break;
+            if (cmd.type == PROVE) {
+                TermId start = intern_tree(ts, cmd.children[0]);
+                TermId target = intern_tree(ts, cmd.children[1]);
+                ProofCache *cache = session.proof_cache.empty() ? &memory : caches.get(session.proof_cache);
+                ProofResult result = prove(ts, axioms, start, target, session, search_pools, cache, &rules,
+                                           &completions);
+                out += format_goal(ts, start, target) + format_result(ts, start, session, result);
+            } else if (cmd.type == PARAM) {
+                apply_param(session, cmd);
+            } else {
+                out += "Error: the axioms are fixed while serving.\n";
+            }
+        }
+        return out + tokenizer.error_text;
+    }
+};
+
+volatile sig_atomic_t ProofServer::stopping = 0;
+
+
+/*
+    Benchmark driver, run with `prover --bench <corpus> [random goals]` or
+    `make bench`. The corpus is ordinary prover input: its axioms all
+    apply to every goal, and each goal keeps the params that were set
+    before it. `random goals` more goals (10 by default) are generated:
+    a random term is rewritten a few times with random applicable rules.
+    The seed is fixed, so each goal has a proof of at most that many
+    steps and each run draws the same goals.
+
+    Every goal is run by every engine, and each run prints one CSV row:
+    whether it was proven, the proof length, states checked, wall time,
+    states per second, the process's peak RSS so far, the time to the
+    first solution (empty when there is none) and, for the BFS engines,
+    the states reached at each depth.
+*/
+struct BenchEngine {
+    string name;
+    function<void(Params &)> configure;
+};
+
+
+long
+peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+
+TermId
+random_term(TermStore &ts, mt19937 &rng, int depth)
+{
+    static const char *LEAVES[] = { "a", "b", "c", "0", "1" };
+    uint32_t r = rng() % 10;
+    if (depth == 0 || r < 3) {
+        string leaf = LEAVES[rng() % 5];
+        return ts.make_leaf(is_prim_token(leaf) ? PRIM : VAR, leaf);
+    }
+    if (r < 5) {
+        return ts.make(OP, ts.symbols.intern("~"), 1, random_term(ts, rng, depth - 1));
+    }
+    TermId a = random_term(ts, rng, depth - 1);
+    TermId b = random_term(ts, rng, depth - 1);
+    return ts.make(OP, ts.symbols.intern(r < 8 ? "+" : "*"), 2, a, b);
+}
+
+
+// A goal start = target with a proof of at most `steps` rewrites.
+pair<TermId, TermId>
+random_goal(TermStore &ts, const RuleIndex &rules, mt19937 &rng, int steps, int max_tree_size)
+{
+    TermId start = random_term(ts, rng, 3);
+    TermId target = start;
+    vector<Successor> successors;
+    for (int i = 0; i < steps; i++) {
+        possible_next_trees(ts, rules, target, successors);
+        vector<TermId> choices;
+        for (const Successor &succ : successors) {
+            TermId v = apply_at(ts, target, succ.position, succ.replacement);
+            // keep generated variables out of goals
+            if (v != target && ts[v].fresh == 0 && (int)ts[v].width <= max_tree_size) choices.push_back(v);
+        }
+        if (choices.empty()) break;
+        target = choices[rng() % choices.size()];
+    }
+    return { start, target };
+}
+
+
+void
+bench(const string &corpus, int random_goals, ostream &out)
+{
+    ifstream file(corpus);
+    if (!file) {
+        throw_failure(ProverError::IO, "run_bench() :: cannot open " + corpus + ".");
+    }
+    Tokenizer tokenizer(file);
+    TermStore ts;
+    Params params;
+    vector<Axiom> axioms;
+    vector<tuple<TermId, TermId, Params>> goals;
+    while (!tokenizer.done()) {
+        Node cmd = parse_command(tokenizer, &ts);
+        if (cmd.type == PROVE) {
+            goals.push_back({ intern_tree(ts, cmd.children[0]), intern_tree(ts, cmd.children[1]), params });
+        } else if (cmd.type == AXIOM) {
+            axioms.push_back(make_axiom(ts, cmd));
+        } else if (cmd.type == PARAM) {
+            apply_param(params, cmd);
+        }
+    }
+    RuleIndex rules(ts, axioms);
+    mt19937 rng(2024);
+    for (int i = 0; i < random_goals; i++) {
+        auto goal = random_goal(ts, rules, rng, 2 + i % 4, params.max_tree_size);
+        goals.push_back({ goal.first, goal.second, params });
+    }
+
+    int threads = max(2, (int)thread::hardware_concurrency());
+    vector<BenchEngine> engines = {
+        { "bfs", [](Params &) {} },
+        { "parallel", [threads](Params &p) { p.threads = threads; } },
+        { "bidirectional", [](Params &p) { p.search_mode = "bidirectional"; } },
+        { "ida_star", [](Params &p) { p.search_mode = "ida_star"; } },
+        { "egraph", [](Params &p) { p.search_mode = "egraph"; } },
+        { "best_first", [threads](Params &p) { p.search_mode = "best_first"; p.threads = threads; } },
+        { "ac", [](Params &p) { p.ac_normalize = true; } },
+        { "completion", [](Params &p) { p.completion = true; } },
+    };
+
+    Completions completions;
+    PoolCache search_pools;
+    out << "engine,goal,ok,steps,states,seconds,states_per_sec,peak_rss_kb,first_solution_s,states_per_depth" << endl;
+    for (const BenchEngine &engine : engines) {
+        for (auto &[start, target, goal_params] : goals) {
+            Params p = goal_params;
+            p.use_proofs_as_axioms = false;
+            p.proof_cache = "";
+            engine.configure(p);
+
+            auto st_clock = chrono::steady_clock::now();
+            ProofResult result = prove(ts, axioms, start, target, p, search_pools, nullptr, &rules, &completions);
+            auto en_clock = chrono::steady_clock::now();
+            double seconds = chrono::duration<double>(en_clock - st_clock).count();
+
+            stringstream levels;
+            for (size_t d = 0; d < result.levels.size(); d++) {
+                levels << (d ? ";" : "") << result.levels[d];
+            }
+            out << engine.name << ",\"" << to_string(ts, start) << " = " << to_string(ts, target) << "\","
+                 << (result.ok ? 1 : 0) << "," << result.path.size() << "," << result.states << ","
+                 << setprecision(6) << fixed << seconds << ","
+                 << setprecision(0) << (seconds > 0 ? result.states / seconds : 0.0) << ","
+                 << peak_rss_kb() << ",";
+            if (result.ok) out << setprecision(6) << seconds;
+            out << "," << levels.str() << endl;
+        }
+    }
+}
+
+
+// What body failed with, or OK.
+ProverStatus
+status_of(const function<void()> &body)
+{
+    try {
+        body();
+    } catch (const ProverFailure &failure) {
+        return { failure.error, failure.message };
+    }
+    return {};
+}
+
+
+// The single command text holds, parsed into ts.
+Node
+parse_single_command(TermStore &ts, const string &text)
+{
+    istringstream in(text);
+    Tokenizer tokenizer(in, false);
+    Node cmd = parse_command(tokenizer, &ts);
+    if (!tokenizer.failed && !tokenizer.done()) tokenizer.error("Expected a single command.", tokenizer.column());
+    if (tokenizer.failed) {
+        tokenizer.error_text.pop_back();  // the newline
+        throw ProverFailure{ ProverError::SYNTAX, tokenizer.error_text };
+    }
+    return cmd;
+}
+
+
+/*
+    What a Prover holds. Proofs take the lock shared and everything else
+    alone, so the axioms and params never change under a search; the
+    term store, the pools, the completions and the caches lock
+    themselves.
+*/
+struct Prover::State {
+    TermStore ts;
+    Params params;
+    vector<Axiom> axioms;
+    unique_ptr<RuleIndex> rules;  // of axioms
+    ProofCaches caches;  // before the pools, so it outlives their workers
+    Completions completions;
+    PoolCache search_pools;
+    shared_mutex lock;
+
+    State() : rules(make_unique<RuleIndex>(ts, axioms)) {}
+};
+
+
+Prover::Prover() : state(make_unique<State>()) {}
+
+Prover::~Prover()
+{
+    save();
+}
+
+
+ProverStatus
+Prover::add_axiom(const string &name, const string &lhs, const string &rhs)
+{
+    unique_lock<shared_mutex> guard(state->lock);
+    return status_of([&] {
+        string text = lhs.empty() && rhs.empty() ? "axiom " + name + " : builtin."
+                                                 : "axiom " + name + " : " + lhs + " = " + rhs + ".";
+        Node cmd = parse_single_command(state->ts, text);
+        state->axioms.push_back(make_axiom(state->ts, cmd));
+        state->rules->add(state->ts, state->axioms.back());
+    });
+}
+
+
+ProverStatus
+Prover::set_param(const string &name, const string &value)
+{
+    unique_lock<shared_mutex> guard(state->lock);
+    return status_of([&] {
+        string text = "param " + name + " " + (is_string_param_token(name) ? "\"" + value + "\"" : value) + ".";
+        apply_param(state->params, parse_single_command(state->ts, text));
+    });
+}
+
+
+ProverStatus
+Prover::prove(const string &lhs, const string &rhs, Proof &proof)
+{
+    shared_lock<shared_mutex> guard(state->lock);
+    return status_of([&] {
+        TermStore &ts = state->ts;
+        const Params &params = state->params;
+        Node cmd = parse_single_command(ts, "prove " + lhs + " = " + rhs + ".");
+        TermId start = intern_tree(ts, cmd.children[0]);
+        TermId target = intern_tree(ts, cmd.children[1]);
+        // the goal does not become a lemma here: that would change the axioms under other proofs
+        ProofResult result = ::prove(ts, state->axioms, start, target, params, state->search_pools,
+                                     state->caches.get(params.proof_cache), state->rules.get(),
+                                     &state->completions);
+        proof = Proof();
+        proof.proven = result.ok;
+        proof.refuted = result.refuted;
+        proof.exhausted = result.exhausted != SearchBudget::NONE;
+        for (auto &step : result.path) proof.steps.push_back({ step.first, to_string(ts, step.second) });
+        proof.states = result.states;
+        proof.seconds = result.seconds;
+        proof.engine = result.stats.engine;
+        proof.text = format_goal(ts, start, target) + format_result(ts, start, params, result);
+    });
+}
+
+
+ProverStatus
+Prover::run(istream &in, ostream &out)
+{
+    unique_lock<shared_mutex> guard(state->lock);
+    return status_of([&] {
+        // commands run as they are read; the prover only takes the outcome if all of them do
+        TermStore &ts = state->ts;
+        Tokenizer tokenizer(in);
+        Params params = state->params;
+        vector<Axiom> axioms = state->axioms;
+        vector<int> lemma_of(axioms.size(), -1);
+        GoalScheduler scheduler(ts, out, state->caches, state->completions, state->search_pools);
+
+        while (!tokenizer.done()) {
+            Node cmd = parse_command(tokenizer, &ts);
+            if (cmd.type == PROVE) {
+                TermId start = intern_tree(ts, cmd.children[0]);
+                TermId target = intern_tree(ts, cmd.children[1]);
+                scheduler.submit(start, target, params, axioms, lemma_of);
+                scheduler.check();
+                if (params.use_proofs_as_axioms) {
+                    // whether it holds is only known once the goal has run
+                    axioms.push_back(lemma_axiom(ts, start, target, params.lemma_orientation == "shrinking"));
+                    lemma_of.push_back(scheduler.size() - 1);
+                }
+
+            } else if (cmd.type == AXIOM) {
+                axioms.push_back(make_axiom(ts, cmd));
+                lemma_of.push_back(-1);
+
+            } else if (cmd.type == PARAM) {
+                apply_param(params, cmd);
+            }
+        }
+        scheduler.finish();
+        scheduler.check();
+        state->caches.save();
+
+        state->axioms.clear();
+        for (size_t i = 0; i < axioms.size(); i++) {
+            if (lemma_of[i] < 0 || scheduler.proved(lemma_of[i])) state->axioms.push_back(axioms[i]);
+        }
+        state->rules = make_unique<RuleIndex>(ts, state->axioms);
+        state->params = params;
+    });
+}
+
+
+ProverStatus
+Prover::serve(int in_fd, int out_fd)
+{
+    return status_of([&] {
+        unique_ptr<ProofServer> server;
+        {
+            shared_lock<shared_mutex> guard(state->lock);
+            server = make_unique<ProofServer>(state->ts, state->params, state->axioms, state->caches,
+                                              state->completions, state->search_pools);
+        }
+        server->serve(in_fd, out_fd);
+        state->caches.save();
+    });
+}
+
+
+ProverStatus
+Prover::listen(const string &socket_path)
+{
+    return status_of([&] {
+        unique_ptr<ProofServer> server;
+        {
+            shared_lock<shared_mutex> guard(state->lock);
+            server = make_unique<ProofServer>(state->ts, state->params, state->axioms, state->caches,
+                                              state->completions, state->search_pools);
+        }
+        server->listen_on(socket_path);
+    });
+}
+
+
+ProverStatus
+Prover::save()
+{
+    return status_of([&] { state->caches.save(); });
+}
+
+
+ProverStatus
+run_bench(const string &corpus, int random_goals, ostream &out)
+{
+    return status_of([&] { bench(corpus, random_goals, out); });
+}
+
+
+ProverStatus
+run_worker(int port)
+{
+    return status_of([&] { DistributedWorker(port).run(); });
+}
@@ -0,0 +1,92 @@
+#ifndef PROVER_HPP
+#define PROVER_HPP
+
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+    The prover as a library, built into libprover.a; `prover` itself is
+    main.cpp, a command line over this header. Nothing in the library
+    prints an error or exits: every call returns a ProverStatus, whose
+    message is what the command line prints for it.
+
+    A Prover owns its terms, axioms and params. Any number of threads may
+    call prove() on one Prover at once; they share the axioms read-only,
+    along with the prover's thread pools, completions and proof caches.
+    Calls that change the prover (add_axiom(), set_param(), run()) wait
+    for the proofs in progress and hold off new ones while they run.
+*/
+
+enum class ProverError {
+    OK,
+    SYNTAX,    // input that does not parse, or a param value that makes no sense
+    IO,        // a file that cannot be read or written: input, proof cache, spill files
+    NETWORK,   // a socket that cannot be set up, or a worker that cannot be reached
+    INTERNAL,  // a broken invariant
+};
+
+struct ProverStatus {
+    ProverError error = ProverError::OK;
+    std::string message;  // what went wrong, as `prover` prints it
+
+    bool ok() const { return error == ProverError::OK; }
+};
+
+struct ProofStep {
+    std::string rule;  // the axiom or lemma applied
+    std::string term;  // what the step rewrote the goal to
+};
+
+struct Proof {
+    bool proven = false;
+    bool refuted = false;    // the sides differ under some assignment of 0 and 1
+    bool exhausted = false;  // param time_limit_ms or memory_limit_mb stopped the search
+    std::vector<ProofStep> steps;
+    int states = 0;
+    double seconds = 0;
+    std::string engine;      // what answered: a search mode, "semantic", "cache", ...
+    std::string text;        // the result as `prover` prints it
+};
+
+class Prover {
+public:
+    Prover();
+    ~Prover();
+    Prover(const Prover &) = delete;
+    Prover &operator=(const Prover &) = delete;
+
+    // axiom name : lhs = rhs, or the builtin axiom name without sides
+    ProverStatus add_axiom(const std::string &name, const std::string &lhs = "", const std::string &rhs = "");
+    // param name value, a string param's value without quotes
+    ProverStatus set_param(const std::string &name, const std::string &value);
+    // prove lhs = rhs under the params set so far; unlike in run(), it never becomes a lemma
+    ProverStatus prove(const std::string &lhs, const std::string &rhs, Proof &proof);
+
+    /*
+        Runs a program in the prover's language, printing its goals in
+        order to out. Its axioms and params stay with the prover, and so
+        do the goals it proved with `param use_proofs_as_axioms true.`.
+    */
+    ProverStatus run(std::istream &in, std::ostream &out);
+
+    // Answers `prove` and `param` lines on a file descriptor pair, or on a unix socket until SIGINT or SIGTERM.
+    ProverStatus serve(int in_fd, int out_fd);
+    ProverStatus listen(const std::string &socket_path);
+
+    // Writes the proof caches, which is otherwise done when the prover goes.
+    ProverStatus save();
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+// Runs every search engine on a corpus, writing one CSV row per goal and engine.
+ProverStatus run_bench(const std::string &corpus, int random_goals, std::ostream &out);
+
+// Serves distributed searches (param workers) on a TCP port; only returns on error.
+ProverStatus run_worker(int port);
+
+#endif